@@ -51,10 +51,13 @@ typedef enum {
 
 #define MADT_TABLE_START         0x2C
 
+#define LAPIC_ID_REG             0x20
 #define LAPIC_TASK_PRIO_REG      0x80
 #define LAPIC_EOI_REG            0xB0
 #define LAPIC_SIV_REG            0xF0  /* spurious interrupt vector reg */
 #define LAPIC_ERROR_STATUS_REG   0x280
+#define LAPIC_ICR_LOW_REG        0x300
+#define LAPIC_ICR_HIGH_REG       0x310
 #define LAPIC_TIMER_REG          0x320
 #define LAPIC_LINT0_REG          0x350
 #define LAPIC_LINT1_REG          0x360
@@ -67,6 +70,13 @@ typedef enum {
 #define LAPIC_ENABLE             0x100
 #define LAPIC_MASK               0x10000 
 
+#define LAPIC_ICR_INIT            0x4500  /* level assert */
+#define LAPIC_ICR_STARTUP         0x4600  /* vector is the page of the code */
+#define LAPIC_ICR_FIXED           0x4000  /* level assert, vector in the low byte */
+#define LAPIC_ICR_PENDING         (1 << 12)
+
+#define MADT_LAPIC_ENABLED        (1 << 0)
+
 #define LAPIC_TIMER_MASK          (1 << 16)
 #define LAPIC_TIMER_PERIODIC      (1 << 17)
 #define LAPIC_TIMER_DIVISION_X1   0xB
@@ -82,10 +92,15 @@ typedef enum {
 #define IOAPIC_MASK              (1 << 16) 
 
 void lapic_sendEOI(void);
+uint32_t lapic_get_id(void);
+void lapic_send_ipi(uint32_t apic_id, uint32_t command);
+void lapic_ap_init(void);
 void ioapic_irq_activate(uint32_t apic_irq, uint32_t irq);
 void ioapic_legacy_irq_activate(uint32_t irq);
 void ioapic_irq_set_mask(uint32_t irq);
 void ioapic_irq_clear_mask(uint32_t irq);
+void lapic_timer_stop(void);
+void lapic_timer_start(void);
 void apic_init(void);
 
 #endif
@@ -12,20 +12,40 @@ typedef struct bio_buf {
         int ref_count;
         int valid;
         int dirty;
-        semaphore_t *mutex;
+        uint64_t dirty_time;   /* ns, first write since it was last written back */
+        mutex_t *mutex;
         uint32_t size;
         uint8_t *buffer;
         struct bio_buf *next;
         struct bio_buf *prev;
 } bio_buf_t;
 
+/* consecutive blocks queued for the readahead task */
+typedef struct {
+        int device;
+        uint32_t block;
+        uint32_t count;
+        uint32_t size;
+} bio_ra_t;
+
 #define BIO_TABLE_SIZE     50
 #define BIO_LOAD_FACTOR    75
 
+/* the flusher runs every BIO_FLUSH_PERIOD ms, and it writes back the
+   buffers that have been dirty for more than BIO_DIRTY_EXPIRE ns */
+#define BIO_FLUSH_PERIOD   1000
+#define BIO_DIRTY_EXPIRE   3000000000ULL
+#define BIO_FLUSH_ALL      (uint64_t)~0
+
+/* read ahead requests waiting for the readahead task, more are dropped */
+#define BIO_RA_QUEUE_SIZE  16
+
 void bio_init(void);
 bio_buf_t* bio_read(int device, uint32_t sector, uint32_t size);
 void bio_write(bio_buf_t *buf);
 void bio_release(bio_buf_t *buf);
+void bio_read_ahead(int device, uint32_t block, uint32_t count, uint32_t size);
+void bio_sync(void);
 void bio_debug_print(void);
 
 #endif
@@ -0,0 +1,37 @@
+#ifndef _KERNEL_BUDDY_H
+#define _KERNEL_BUDDY_H
+
+#include <stdint.h>
+
+/* biggest block is 2^BUDDY_MAX_ORDER pages, 4 MiB */
+#define BUDDY_MAX_ORDER     10
+#define BUDDY_ORDERS        (BUDDY_MAX_ORDER + 1)
+#define BUDDY_NONE          (uint32_t)~0
+
+/* per page info, only meaningful for the first page of a block */
+#define BUDDY_FREE          (1 << 7)
+#define BUDDY_INVALID       0x7F
+
+typedef struct {
+        uint32_t next;
+        uint32_t prev;
+} buddy_link_t;
+
+typedef struct {
+        uintptr_t start;          /* physical address of first page of the zone */
+        uint32_t pages;
+        uint32_t free_pages;
+        uint32_t free_heads[BUDDY_ORDERS];
+        uint8_t *orders;
+        buddy_link_t *links;
+} buddy_zone_t;
+
+void buddy_init(uintptr_t start, uint32_t pages);
+uint32_t buddy_order(uint32_t pages);
+void *buddy_alloc(uint32_t order);
+void buddy_free(void *page);
+int buddy_owns(void *page);
+uint32_t buddy_free_pages(void);
+void buddy_print_info(void);
+
+#endif
@@ -9,7 +9,7 @@ typedef struct dentry {
         int ref_count;
         uint32_t offset; /* offset in dir inode buffer */
         struct inode *inode;
-        struct semaphore *mutex;
+        struct mutex *mutex;
         struct dentry *next;
         struct dentry *prev;
 
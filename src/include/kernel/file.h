@@ -42,12 +42,14 @@ typedef struct file {
 int inode_write(file_t *file, void *addr, size_t size);
 int inode_read(file_t *file, void *addr, size_t size);
 void inode_stat(file_t *file, stat_t *stat);
+void inode_close(file_t *file);
 
 void file_init(void);
 int file_open(char *path, int flags);
 int file_write(file_t *file, void *addr, size_t size);
 int file_read(file_t *file, void *addr, size_t size);
 file_t* file_alloc(void);
+file_t* file_dup(file_t *file);
 void file_close(file_t *file);
 int file_stat(file_t *file, stat_t *statbuf);
 
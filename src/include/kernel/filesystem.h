@@ -145,6 +145,10 @@ typedef enum {
 #define IND2_LIMIT         (IND1_LIMIT + IND2_PTR_BLOCKS)
 #define IND3_LIMIT         (IND2_LIMIT + IND3_PTR_BLOCKS)
 
+/* window of a sequential reader, the buffer cache is small */
+#define RA_MIN_BLOCKS      4
+#define RA_MAX_BLOCKS      16
+
 #define RUP_DIVISION(X, Y)   ((X + (Y - 1)) / Y)
 
 void ext2_init(int device);
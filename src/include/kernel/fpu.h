@@ -0,0 +1,36 @@
+#ifndef _KERNEL_FPU_H
+#define _KERNEL_FPU_H
+
+#include <stdint.h>
+
+#include <kernel/task.h>
+#include <kernel/smp.h>
+
+#define FPU_STATE_SIZE        512      /* fxsave area */
+#define FPU_STATE_ALIGN       16
+#define FPU_NO_CPU            CPU_MAX
+
+#define CR0_MP                (1 << 1)
+#define CR0_EM                (1 << 2)
+#define CR0_TS                (1 << 3)
+#define CR0_NE                (1 << 5)
+#define CR4_OSFXSR            (1 << 9)
+#define CR4_OSXMMEXCPT        (1 << 10)
+
+#define CPUID_EDX_FXSR        (1 << 24)
+#define CPUID_EDX_SSE         (1 << 25)
+
+void fpu_init(void);
+void fpu_cpu_init(void);
+void fpu_switch(task_info_t *prev);
+void fpu_trap_handler(void);
+void fpu_fork(task_info_t *child);
+void fpu_free(task_info_t *task);
+
+/* kernel code can use fpu and sse registers only between these, the
+   task isn't preempted in between so it can't be used in interrupt
+   handlers */
+void kernel_fpu_begin(void);
+void kernel_fpu_end(void);
+
+#endif
@@ -39,9 +39,16 @@ typedef struct
         uint32_t offset;
 } __attribute__ ((packed)) gdt_ptr_t;
 
-#define GDT_ENTRIES    6
+#define GDT_ENTRIES       7
+/* its limit is the index of the cpu, see cpu_current */
+#define GDT_CPU_ENTRY     6
+#define GDT_CPU_SELECTOR  (GDT_CPU_ENTRY * sizeof(gdt_entry_t) | 3)
+
+struct tss;
 
 void gdt_init(void);
+gdt_ptr_t *gdt_cpu_create(struct tss *cpu_tss, uint32_t cpu_id);
 extern void gdt_flush(gdt_ptr_t *gdt_ptr);
+extern gdt_ptr_t *gdt_ptr;
 
 #endif
@@ -66,6 +66,8 @@ void hpet_disable(void);
 
 /* 1 ns_100 = 100ns */
 void hpet_set_comparator(uint32_t timer, uint64_t ns_100);
+void hpet_set_deadline(uint32_t timer, uint64_t ns);
+void hpet_timer_ack(uint32_t timer);
 void hpet_create_timer(uint32_t timer, uint32_t irq, void(*func)(interrupt_frame_t*));
 uint64_t hpet_read_counter(void);
 uint64_t hpet_get_ns(void);
@@ -5,12 +5,31 @@
 #include <stddef.h>
 
 #include <kernel/task.h>
+#include <kernel/memory.h>
+#include <kernel/spinlock.h>
 
+/* a piece of the memory of a transfer, the pieces of a transfer
+   are consecutive on the disk */
 typedef struct {
-        uintptr_t addr;
-        uintptr_t ctrl_addr;
-        uintptr_t bus_master_addr;
-} ide_channel_t;
+        void *buffer;
+        size_t size;
+} ide_sg_t;
+
+/* block request, the submitter waits for it with ide_wait. Requests
+   can't overlap on the disk, the buffer cache has a single buffer
+   for a block and it's locked during the transfer */
+typedef struct ide_request {
+        uint8_t device;
+        int is_write;
+        size_t lba;
+        size_t size;               /* bytes, the pieces together */
+        ide_sg_t *sg;
+        uint32_t sg_count;
+        uint32_t pages;            /* prd entries it needs at most */
+        volatile int done;
+        task_info_t *task;         /* waiting for it, NULL if none */
+        struct ide_request *next;
+} ide_request_t;
 
 typedef struct {
         uint8_t present;
@@ -22,6 +41,8 @@ typedef struct {
         uint32_t commmand_set;
         uint32_t size;
         uint8_t model[41];
+        ide_request_t *queue;      /* sorted by lba */
+        size_t next_lba;           /* after the last dispatched command */
 } ide_device_t;
 
 typedef struct {
@@ -30,11 +51,26 @@ typedef struct {
         uint16_t reserved;
 } __attribute__ ((packed)) prd_entry_t;
 
+/* command running on a channel, the requests merged in it are
+   linked through their next field, device is NULL if it's idle */
 typedef struct {
         ide_device_t *device;
-        task_info_t  *task;
+        ide_request_t *requests;
 } disk_request_t;
 
+/* the two channels run their commands in parallel, each one has its
+   own prd table and interrupt. The lock guards the running command
+   and the queues of the two drives of the channel */
+typedef struct {
+        uintptr_t addr;
+        uintptr_t ctrl_addr;
+        uintptr_t bus_master_addr;
+        spinlock_t lock;
+        prd_entry_t *prd_table;
+        disk_request_t request;
+        uint32_t last_drive;       /* drives with requests take turns */
+} ide_channel_t;
+
 #define IDE_COMP_PORTS1        0x1F0
 #define IDE_COMP_CTRL_PORTS1   0x3F6
 #define IDE_COMP_PORTS2        0x170
@@ -122,9 +158,19 @@ typedef struct {
 
 #define SECTOR_SIZE     512
 
+/* bytes a single access can transfer, a prd region can't cross a
+   64 KiB boundary and it's 64 KiB at most */
+#define IDE_MAX_TRANSFER   KIB(64)
+#define IDE_PRD_BOUNDARY   KIB(64)
+#define IDE_PRD_ENTRIES    (KIB(1) / sizeof(prd_entry_t))
+#define IDE_PRD_LAST       (1 << 15)
+
 void ide_write_disk(uint8_t device, void *buffer, size_t addr, size_t size);
-void ide_read_disk(uint8_t device, size_t addr, size_t size);
-void ide_read_disk_buffer(void *buffer, size_t offset, size_t size);
+void ide_read_disk(uint8_t device, void *buffer, size_t addr, size_t size);
+void ide_submit(ide_request_t *req);
+void ide_wait(ide_request_t *req);
+void ide_write_disk_sg(uint8_t device, ide_sg_t *sg, uint32_t count, size_t addr);
+void ide_read_disk_sg(uint8_t device, ide_sg_t *sg, uint32_t count, size_t addr);
 void ide_set(uint32_t bus, uint32_t device, uint32_t func);
 void ide_init(void);
 
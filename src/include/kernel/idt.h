@@ -50,6 +50,7 @@ typedef struct
 void idt_create(idt_entry_t *descriptor, uintptr_t offset, idt_flag_t flags);
 void idt_init(void);
 extern void idt_flush(idt_ptr_t *idt_ptr);
+extern idt_ptr_t *idt_ptr;
 extern idt_entry_t *idt_entries;
 
 #endif
@@ -16,7 +16,7 @@ typedef struct inode {
         int ref_count;
         int device;
         uint32_t n;
-        struct semaphore *mutex;
+        struct mutex *mutex;
        
         uint16_t mode;
         uint16_t hard_links_count;
@@ -28,6 +28,10 @@ typedef struct inode {
         uint32_t sectors;
         uint32_t blocks[INODE_BLOCKS_COUNT];
 
+        uint32_t ra_next;        /* block after the last one read */
+        uint32_t ra_end;         /* blocks before it have been read ahead */
+        uint32_t ra_window;      /* blocks read ahead, 0 if not sequential */
+
         int (*write)(struct inode *, void *, size_t, size_t);
         int (*read)(struct inode *, void *, size_t, size_t);
         /*
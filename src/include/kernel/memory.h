@@ -12,6 +12,8 @@
 #define KHEAP_BLOCK_START    (0xE0000000 - 0x1000)
 #define PDE_LAST_INDEX_START 0xFFC00000
 #define PAGE_LAST_DWORD      ((PAGE_FRAME_SIZE - 1) / 4)
+#define USER_STACK_TOP       KERNEL_OFFSET
+#define USER_STACK_SIZE      KIB(128)  /* reserved, mapped on demand */
 
 #define VIR2PHY(addr)        (addr - KERNEL_OFFSET)
 #define PHY2VIR(addr)        (addr + KERNEL_OFFSET)
@@ -3,33 +3,84 @@
 
 #include <stdint.h>
 
+#include <kernel/spinlock.h>
+
+struct task_info;
+
+/* tasks waiting for a condition in FIFO order, the queue is embedded
+   in the structure that owns the condition, waiting tasks are linked
+   through their next field */
+typedef struct wait_queue {
+        spinlock_t lock;
+        struct task_info *head;
+        struct task_info *tail;
+} wait_queue_t;
+
+/* task.h includes pipe.h, which embeds wait queues */
 #include <kernel/task.h>
 
 struct semaphore {
+        spinlock_t lock;
         uint32_t max_count;
         uint32_t current_count;
         struct task_info *waiting_tasks_start;
         struct task_info *waiting_tasks_end;
 };
 
-typedef struct condvar {
-        void *condition;
-        struct task_info *tasks;
-        struct condvar *next;
-} condvar_t;
- 
 typedef struct semaphore semaphore_t;
 
+/* flags of mutex_t */
+#define MUTEX_PI            1     /* the owner inherits the priority of the waiters */
+
+/* a task spins this many times before it sleeps while the owner runs */
+#define MUTEX_SPIN_COUNT    4096
+
+/* sleeping lock with an owner, most critical sections are short so a
+   task spins while the owner is running on another cpu, and it sleeps
+   only if the owner doesn't release it soon. The mutex is handed over
+   to the first waiting task when it's released */
+typedef struct mutex {
+        spinlock_t lock;                      /* waiting list */
+        struct task_info *volatile owner;
+        uint32_t flags;
+        struct task_info *waiting_tasks_start;
+        struct task_info *waiting_tasks_end;
+        struct mutex *pi_next;                /* next PI mutex held by the owner */
+} mutex_t;
+
+/* sleeping reader-writer lock, a waiting writer stops new readers
+   from getting in, the lock is handed over to the waiting tasks when
+   it's released */
+typedef struct rwsem {
+        spinlock_t lock;
+        int32_t count;                    /* readers holding it, -1 if a writer does */
+        struct task_info *readers;        /* waiting readers, woken all together */
+        struct task_info *writers_start;  /* waiting writers, in FIFO order */
+        struct task_info *writers_end;
+} rwsem_t;
+
+void mutex_init(void);
+
 semaphore_t *semaphore_create(uint32_t max_count);
-semaphore_t *mutex_create(void);
+void semaphore_free(semaphore_t *semaphore);
 void semaphore_acquire(semaphore_t *semaphore);
-void mutex_acquire(semaphore_t *mutex);
 void semaphore_release(semaphore_t *semaphore);
-void mutex_release(semaphore_t *mutex);
 
-condvar_t *condvar_alloc(void *condition);
-void condvar_wait(void *condition, semaphore_t *mutex);
-void condvar_signal(void *condition);
-void condvar_free(void *condition);
+mutex_t *mutex_create(void);
+mutex_t *mutex_pi_create(void);
+void mutex_free(mutex_t *mutex);
+void mutex_acquire(mutex_t *mutex);
+void mutex_release(mutex_t *mutex);
+
+void rwsem_init(rwsem_t *sem);
+void rwsem_down_read(rwsem_t *sem);
+void rwsem_up_read(rwsem_t *sem);
+void rwsem_down_write(rwsem_t *sem);
+void rwsem_up_write(rwsem_t *sem);
+
+void wait_queue_init(wait_queue_t *queue);
+void wait_queue_wait(wait_queue_t *queue, mutex_t *mutex);
+void wait_queue_wake_one(wait_queue_t *queue);
+void wait_queue_wake_all(wait_queue_t *queue);
 
 #endif
@@ -10,8 +10,13 @@ typedef uintptr_t pd_entry_t;
 
 #define NUM_OF_ENTRIES 1024
 #define PAGE_MEMORY    (NUM_OF_ENTRIES * PAGE_FRAME_SIZE) /* size of entire page of memory */
+#define PAGE_LARGE_MASK (PAGE_MEMORY - 1) /* offset inside a 4 MiB page */
+#define PAGE_KERNEL_INDEX   (KERNEL_OFFSET >> 22) /* first PDE of the kernel half */
+#define PAGE_RECURSIVE_DIR  ((pd_entry_t*)RECURSIVE_INDEX(NUM_OF_ENTRIES - 1))
+/* temporary mappings of frames that aren't in the current address space */
+#define PAGE_SCRATCH_START  0xFF800000
 /* useful macro for recursively accessing page tables and page directory */
-#define RECURSIVE_INDEX(index) (PDE_LAST_INDEX_START + index * PAGE_FRAME_SIZE)
+#define RECURSIVE_INDEX(index) (PDE_LAST_INDEX_START + (index) * PAGE_FRAME_SIZE)
 
 typedef enum {
         PD_PRESENT =        (1 << 0),
@@ -20,7 +25,7 @@ typedef enum {
         PD_PWT =            (1 << 3), /* write-through */
         PD_PCD =            (1 << 4), /* cache disabled */
         PD_ACCESSED =       (1 << 5), 
-        PD_PAGESIZE =       (1 << 7), /* page size, NEVER SET THIS */
+        PD_PAGESIZE =       (1 << 7), /* 4 MiB page, CR4.PSE is set in boot.S */
 } pd_flags_t;
 
 typedef enum {
@@ -33,21 +38,67 @@ typedef enum {
         PT_DIRTY =          (1 << 6),
         PT_PAT =            (1 << 7), /* page attribute table, should be 0 */
         PT_GLOBAL =         (1 << 8),
+        PT_COW =            (1 << 9), /* available bit, copy on write page */
 } pt_flags_t;
 
+/* page fault error code */
+typedef enum {
+        PF_PRESENT =        (1 << 0), /* 0 means the page wasn't present */
+        PF_WRITE =          (1 << 1),
+        PF_USER =           (1 << 2),
+} pf_error_t;
+
+enum {
+        PAGE_SCRATCH_DIR = 0,
+        PAGE_SCRATCH_TABLE,
+        PAGE_SCRATCH_COPY,
+        PAGE_SCRATCH_SYNC,        /* one slot for each cpu */
+};
+
+/* past this many invalidations the whole TLB is flushed */
+#define PAGE_FLUSH_MAX 32
+/* sent to the other cpus when kernel half entries are invalidated */
+#define PAGE_SHOOTDOWN_VECTOR 0xF1
+
+typedef struct {
+        uint32_t count;
+        uint32_t kernel;               /* the other cpus have to invalidate too */
+        uintptr_t addrs[PAGE_FLUSH_MAX];
+        uint32_t frame_count;
+        void *frames[PAGE_FLUSH_MAX];  /* freed once no TLB has them anymore */
+} page_flush_t;
+
 typedef enum {
         NO_ALLOC = 0,
         PAGE_ALLOC,
 } alloc_flag_t;
 
 extern pd_entry_t *page_directory;
+extern uintptr_t kernel_page_dir;
+extern uint32_t kernel_pde_version;
 
 void page_init(void);
+void page_shootdown_init(void);
 
 void page_identity_map(pd_entry_t *page_dir, uintptr_t start_addr, uintptr_t size);
+void page_identity_map_mmio(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size);
 page_entry_t *page_get_pt(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag);
 page_entry_t *page_get_pt_entry(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag);
 uintptr_t page_get_phys_addr(pd_entry_t *page_dir, uintptr_t addr);
+int page_map(pd_entry_t *page_dir, uintptr_t addr, void *frame, pt_flags_t flags);
+void *page_unmap(pd_entry_t *page_dir, uintptr_t addr);
+int page_map_range(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size, pt_flags_t flags);
+void page_unmap_range(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size, int free_frames);
+void page_flush_add(page_flush_t *flush, uintptr_t addr);
+void page_flush_finish(page_flush_t *flush);
+void page_flush_all(void);
+int page_sync_kernel_pde(uintptr_t addr);
+uintptr_t page_dir_create(void);
+uintptr_t page_dir_fork(void);
+uint32_t page_dir_sync(uintptr_t page_dir, uint32_t version);
+void page_dir_destroy(uintptr_t page_dir);
+int page_handle_cow(uintptr_t addr);
+int page_fault_handler(uintptr_t addr, uint32_t error_code);
 void pd_add_table(pd_entry_t *pd_entry, page_entry_t *page_entry, pd_flags_t flags);
 void pt_add_entry(page_entry_t *pt_entry, void *page, pt_flags_t flags);
 
@@ -57,6 +108,18 @@ page_get_pt_index(uintptr_t addr)
         return addr >> 12 & 0x3FF;
 }
 
+static inline int
+page_is_large(pd_entry_t pd_entry)
+{
+        return (pd_entry & (PD_PRESENT | PD_PAGESIZE)) == (PD_PRESENT | PD_PAGESIZE);
+}
+
+static inline void
+page_invalidate(uintptr_t addr)
+{
+        asm volatile ("invlpg (%0)" : : "r" (addr) : "memory");
+}
+
 static inline uint32_t
 page_get_pd_index(uintptr_t addr)
 {
@@ -10,7 +10,7 @@
 typedef struct file file_t;
 
 typedef struct pipe {
-        struct semaphore *mutex;
+        struct mutex *mutex;
         uint32_t size : 30;
         uint32_t type : 2;
         uint32_t b_read;
@@ -18,6 +18,8 @@ typedef struct pipe {
         uint32_t read_open;
         uint32_t write_open;
         uint8_t *buffer;
+        wait_queue_t readers;     /* waiting for data */
+        wait_queue_t writers;     /* waiting for space */
 } pipe_t;
 
 typedef enum {
@@ -4,11 +4,21 @@
 #include <stdint.h>
 
 #define BIT32_MAX         (uint32_t)~0
+/* 1 / PMM_BUDDY_ZONE_DIV of the biggest memory region goes to the buddy allocator */
+#define PMM_BUDDY_ZONE_DIV  4
+/* enough summary dwords for 4 GiB, a summary bit covers 32 pages */
+#define PMM_SUMMARY_WORDS   (0x100000 / 32 / 32)
 
 void pmm_init(void);
+void pmm_buddy_init(void);
+void pmm_refs_init(void);
 void *pmm_alloc(void);
 void *pmm_allocs(uint32_t size);
 void pmm_free(void *page_frame);
 void pmm_frees(void *page_frame, uint32_t size);
+uint32_t pmm_free_pages(void);
+void pmm_frame_share(void *frame);
+uint32_t pmm_frame_shared(void *frame);
+void pmm_frame_release(void *frame);
 
 #endif
@@ -0,0 +1,43 @@
+#ifndef _KERNEL_SLAB_H
+#define _KERNEL_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <kernel/spinlock.h>
+
+/* enough for uint64_t fields and for the free list pointer
+   that is stored inside free objects */
+#define SLAB_ALIGN          8
+
+/* a slab is a single page, the header is at the start of the page
+   and the objects fill the rest of it */
+typedef struct kmem_slab {
+        struct kmem_cache *cache;
+        struct kmem_slab *next;
+        struct kmem_slab *prev;
+        void *free;                    /* first free object of the slab */
+        uint32_t used;
+} kmem_slab_t;
+
+/* every cache has its own lock, it's taken with interrupts disabled
+   because the fpu trap allocates from a cache */
+typedef struct kmem_cache {
+        spinlock_t lock;
+        const char *name;
+        size_t size;                   /* object size after alignment */
+        uint32_t objs_per_slab;
+        kmem_slab_t *partial;          /* slabs with used and free objects */
+        kmem_slab_t *full;
+        kmem_slab_t *empty;
+        uint32_t slabs;
+        uint32_t allocated;
+        struct kmem_cache *next;
+} kmem_cache_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *obj);
+void kmem_cache_print_info(void);
+
+#endif
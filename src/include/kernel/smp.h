@@ -0,0 +1,45 @@
+#ifndef _KERNEL_SMP_H
+#define _KERNEL_SMP_H
+
+#include <stdint.h>
+
+#include <kernel/gdt.h>
+#include <kernel/tss.h>
+
+#define CPU_MAX              8
+/* the startup ipi gives the page of the trampoline, it has to be
+   in the first MiB and page aligned */
+#define AP_TRAMPOLINE_ADDR   0x8000
+#define AP_STARTUP_TIMEOUT   100000000  /* ns */
+
+struct task_info;
+
+/* offsets are used in kernel/proc/task_switch.S */
+typedef struct cpu {
+        uint32_t id;                   /* index in cpus */
+        uint32_t apic_id;
+        struct task_info *task;        /* current task */
+        tss_t *tss;
+        struct task_info *idle;
+        gdt_ptr_t *gdt_ptr;
+        volatile uint32_t started;
+        struct task_info *fpu_owner;   /* task whose fpu state is in the registers */
+} cpu_t;
+
+extern cpu_t cpus[CPU_MAX];
+extern uint32_t cpu_count;
+
+/* the limit of the cpu descriptor in the gdt of every cpu is the index
+   of the cpu, lsl leaves id untouched if the descriptor isn't loaded yet */
+static inline cpu_t*
+cpu_current(void)
+{
+        uint32_t id = 0;
+        asm volatile ("lsl %1, %0" : "+r"(id) : "r"(GDT_CPU_SELECTOR));
+        return cpus + id;
+}
+
+void smp_add_cpu(uint32_t apic_id, int is_bsp);
+void smp_init(void);
+
+#endif
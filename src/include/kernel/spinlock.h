@@ -0,0 +1,190 @@
+#ifndef _KERNEL_SPINLOCK_H
+#define _KERNEL_SPINLOCK_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <kernel/smp.h>
+
+#define EFLAGS_IF        (1 << 9)
+
+/* a spinlock is for short critical sections that don't sleep, the
+   task holding it can't block. A lock that is also taken by interrupt
+   handlers, or that is held while the task could be preempted, has to
+   be taken with the irqsave variants */
+
+/* owner is the id of the cpu holding the lock plus 1, 0 if it's free,
+   it's only kept when debugging */
+typedef struct {
+        volatile uint32_t locked;
+#ifdef DEBUG
+        uint32_t owner;
+#endif
+} spinlock_t;
+
+/* tickets are served in order, cpus get the lock in the order they
+   asked for it, so a contended lock can't starve one of them */
+typedef struct {
+        volatile uint16_t next;
+        volatile uint16_t serving;
+#ifdef DEBUG
+        uint32_t owner;
+#endif
+} ticket_lock_t;
+
+#define SPINLOCK_INIT    { 0 }
+#define TICKET_LOCK_INIT { 0 }
+
+static inline uint32_t
+irq_save(void)
+{
+        uint32_t flags;
+        asm volatile ("pushfl\n\t"
+                      "popl %0\n\t"
+                      "cli\n\t"
+                      : "=r"(flags) : : "memory");
+        return flags;
+}
+
+static inline void
+irq_restore(uint32_t flags)
+{
+        if (flags & EFLAGS_IF)
+                asm volatile ("sti" : : : "memory");
+}
+
+#ifdef DEBUG
+
+/* taking a lock twice on the same cpu would spin forever */
+static inline void
+lock_debug_acquire(uint32_t *owner)
+{
+        if (*owner == cpu_current()->id + 1) {
+                printf("[LOCK] lock at %x already held by cpu %d\n", owner, cpu_current()->id);
+                abort();
+        }
+}
+
+static inline void
+lock_debug_acquired(uint32_t *owner)
+{
+        *owner = cpu_current()->id + 1;
+}
+
+static inline void
+lock_debug_release(uint32_t *owner)
+{
+        if (*owner != cpu_current()->id + 1) {
+                printf("[LOCK] lock at %x released by cpu %d, owner: %d\n",
+                       owner, cpu_current()->id, *owner);
+                abort();
+        }
+
+        *owner = 0;
+}
+
+#else
+
+#define lock_debug_acquire(owner)
+#define lock_debug_acquired(owner)
+#define lock_debug_release(owner)
+
+#endif
+
+static inline void
+spin_lock(spinlock_t *lock)
+{
+        lock_debug_acquire(&lock->owner);
+
+        while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+                while (lock->locked)
+                        asm volatile ("pause");
+
+        lock_debug_acquired(&lock->owner);
+}
+
+/* returns 1 if the lock has been taken */
+static inline int
+spin_trylock(spinlock_t *lock)
+{
+        if (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE))
+                return 0;
+
+        lock_debug_acquired(&lock->owner);
+        return 1;
+}
+
+static inline void
+spin_unlock(spinlock_t *lock)
+{
+        lock_debug_release(&lock->owner);
+        __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+spin_lock_irqsave(spinlock_t *lock)
+{
+        uint32_t flags = irq_save();
+        spin_lock(lock);
+        return flags;
+}
+
+static inline void
+spin_unlock_irqrestore(spinlock_t *lock, uint32_t flags)
+{
+        spin_unlock(lock);
+        irq_restore(flags);
+}
+
+static inline void
+ticket_lock(ticket_lock_t *lock)
+{
+        lock_debug_acquire(&lock->owner);
+
+        uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket)
+                asm volatile ("pause");
+
+        lock_debug_acquired(&lock->owner);
+}
+
+/* returns 1 if the lock has been taken, a ticket is only taken if
+   it's the one being served. serving can't change while the lock is
+   free, so if next still matches it the lock is free */
+static inline int
+ticket_trylock(ticket_lock_t *lock)
+{
+        uint16_t ticket = __atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&lock->next, &ticket, ticket + 1, 0,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                return 0;
+
+        lock_debug_acquired(&lock->owner);
+        return 1;
+}
+
+/* only the owner writes serving, it doesn't need an atomic increment */
+static inline void
+ticket_unlock(ticket_lock_t *lock)
+{
+        lock_debug_release(&lock->owner);
+        __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32_t
+ticket_lock_irqsave(ticket_lock_t *lock)
+{
+        uint32_t flags = irq_save();
+        ticket_lock(lock);
+        return flags;
+}
+
+static inline void
+ticket_unlock_irqrestore(ticket_lock_t *lock, uint32_t flags)
+{
+        ticket_unlock(lock);
+        irq_restore(flags);
+}
+
+#endif
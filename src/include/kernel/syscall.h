@@ -81,6 +81,7 @@ enum {
         SYS_DUP, /* 41 */
         SYS_PIPE, /* 42 */
         SYS_READDIR = 460,
+        SYS_HEAPSTAT, /* 461 */
         SYSCALL_COUNT, /* not real syscall, only for size purpose */
 };
 
@@ -96,6 +97,7 @@ enum {
 #define STDOUT  1
 
 void syscall_init(void);
+void syscall_cpu_init(uintptr_t esp0);
 extern void syscall_entry(void);
 
 #endif
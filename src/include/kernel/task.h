@@ -5,8 +5,10 @@
 
 #include <kernel/file.h>
 #include <kernel/dir.h>
+#include <kernel/smp.h>
 
 #define OPEN_FILES_COUNT   16
+#define TASK_PRIORITIES    8
 
 typedef struct task_info {
         uint32_t pid;
@@ -21,6 +23,17 @@ typedef struct task_info {
         uint64_t time_used;
         uint64_t wake_up_time;
         char     name[8];
+        uint32_t kernel_version;  /* kernel half version of page_dir */
+        uint32_t priority;        /* its own priority, 0 is the highest */
+        uint32_t rq_priority;     /* run queue it's on, set when it's queued */
+        uint64_t slice_start;     /* time_used when the task got the cpu */
+        uint32_t cpu;             /* last cpu the task ran on */
+        uint64_t last_run;        /* ns, when the task left its cpu */
+        volatile uint32_t on_cpu; /* its stack is still in use by a cpu */
+        volatile uint32_t inherited; /* from mutex waiters, TASK_PRIORITIES if none */
+        struct mutex *pi_held;    /* PI mutexes it holds, linked through pi_next */
+        void     *fpu_state;      /* fxsave area, NULL until it uses the fpu */
+        uint32_t fpu_cpu;         /* cpu that loaded its fpu state last */
 } __attribute__((packed)) task_info_t;
 
 typedef enum {
@@ -34,19 +47,39 @@ typedef enum {
         CONDVAR,
 } task_state_t;
 
-extern task_info_t *current_task;
+/* every cpu runs its own task */
+#define current_task    (cpu_current()->task)
+
+/* a task holding a PI mutex runs at least at the priority of the tasks
+   waiting for it, its own priority is kept for when it releases it */
+static inline uint32_t
+task_effective_priority(task_info_t *task)
+{
+        uint32_t inherited = task->inherited;
+        return (inherited < task->priority) ? inherited : task->priority;
+}
 
 void multitask_init(void);
+task_info_t *task_cpu_create(char *name);
+void task_tickless_init(void);
+void task_idle(void);
+void task_wake_cpu(uint32_t cpu);
 
 void task_add_node(task_info_t *task);
 task_info_t *task_kernel_create_new(void (*func)(), char *name);
 task_info_t *task_user_create_new(void (*func)(), char *name);
 void task_force_switch(task_info_t *task);
+int task_fork(void);
 
+void task_lock_scheduler(void);
+void task_unlock_scheduler(void);
 void task_lock(void);
 void task_unlock(void);
 void task_block(task_state_t reason);
+void task_wait(void);
+void task_wait_locked(void);
 void task_unblock(task_info_t *task);
+void task_inherit_priority(task_info_t *task, uint32_t priority);
 void nano_sleep_until(uint64_t ns);
 
 void task_print_info(void);
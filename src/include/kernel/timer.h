@@ -0,0 +1,24 @@
+#ifndef _KERNEL_TIMER_H
+#define _KERNEL_TIMER_H
+
+#include <stdint.h>
+
+/* the timer is owned by the caller, it has to stay valid until
+   it expires or it's cancelled, and it can't be added twice. The
+   queue is linked through the timers, there isn't any limit */
+typedef struct timer {
+        uint64_t expires;         /* ns, compared with hpet_get_ns */
+        void (*func)(void *data); /* called from the timer interrupt of the BSP */
+        void *data;
+        int queued;
+        struct timer *child;      /* first child in the heap */
+        struct timer *next;       /* next sibling */
+        struct timer *prev;       /* previous sibling, the parent for the first child */
+} timer_t;
+
+void timer_add(timer_t *timer, uint64_t expires, void (*func)(void*), void *data);
+int timer_cancel(timer_t *timer);
+void timer_run(void);
+uint64_t timer_next(void);
+
+#endif
@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-typedef struct 
+typedef struct tss
 {
         uint16_t link;
         uint16_t reserved_link;
@@ -56,6 +56,7 @@ typedef struct
 extern tss_t *tss;
 
 void tss_init(void);
+void tss_setup(tss_t *cpu_tss);
 void tss_set(uintptr_t stack);
 extern void tss_flush(void);
 
@@ -2,18 +2,53 @@
 #define _KERNEL_VMM_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+/* small blocks are served by power of two size classes, from 16 to 2048
+   bytes, size header included */
+#define VMM_CLASS_MIN_SHIFT  4
+#define VMM_CLASS_MAX_SHIFT  11
+#define VMM_CLASS_MIN        (1 << VMM_CLASS_MIN_SHIFT)
+#define VMM_CLASS_MAX        (1 << VMM_CLASS_MAX_SHIFT)
+#define VMM_CLASSES          (VMM_CLASS_MAX_SHIFT - VMM_CLASS_MIN_SHIFT + 1)
+
+/* bigger blocks get a run of whole pages from the block heap, freed runs
+   are kept for a run of the same length, only longer ones use the list */
+#define VMM_RUN_MAX          32
+
+/* free pages of the block heap that stay mapped, beyond this
+   their frames are given back to the PMM */
+#define VMM_BLOCK_CACHED_MAX 16
 
 typedef struct node_t {
-        union {
-                size_t size;
-                uintptr_t addr;
-        };
+        size_t size;
         struct node_t *next;
 } node_t; 
 
+typedef struct {
+        uint32_t bytes_allocated;      /* header included */
+        uint32_t bytes_peak;
+        uint32_t bytes_free;
+        uint32_t largest_free;
+        uint32_t nodes;                /* free nodes of the list allocator */
+        uint32_t class_allocs[VMM_CLASSES];
+        uint32_t class_frees[VMM_CLASSES];
+        uint32_t list_allocs;
+        uint32_t list_frees;
+        uint32_t block_allocs;
+        uint32_t block_frees;
+        uint32_t run_allocs;           /* runs of more than a page */
+        uint32_t run_frees;
+        uint64_t list_alloc_cycles;    /* time spent in vmm_list_alloc */
+        uint64_t kfree_cycles;
+} vmm_stats_t;
+
 void vmm_init(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void vmm_print_kheap(void);
+void vmm_get_stats(vmm_stats_t *stats);
+void vmm_print_stats(void);
+int vmm_is_demand_addr(uintptr_t addr);
 
 #endif
@@ -26,22 +26,22 @@ gdt_create(gdt_entry_t *descriptor, uint32_t base, uint32_t limit,
            delete precedently assigned limit */
         descriptor->flags_limit |= flags << 4;
 }
-        
-void
-gdt_init(void)
-{
-        kprintf("[GDT] setup STARTING\n");
 
+/* every cpu has its own gdt, they differ in the task state segment
+   and in the limit of the cpu descriptor */
+gdt_ptr_t*
+gdt_cpu_create(tss_t *cpu_tss, uint32_t cpu_id)
+{
         size_t gdt_size = sizeof(gdt_entry_t) * GDT_ENTRIES;
 
-        gdt_entries = kmalloc(gdt_size);
-        gdt_ptr = kmalloc(sizeof(gdt_ptr_t));
+        gdt_entry_t *entries = kmalloc(gdt_size);
+        gdt_ptr_t *ptr = kmalloc(sizeof(gdt_ptr_t));
         
-        gdt_ptr->size = gdt_size - 1;
-        gdt_ptr->offset = (uintptr_t) gdt_entries;
+        ptr->size = gdt_size - 1;
+        ptr->offset = (uintptr_t) entries;
 
         /* first empty entry, null descriptor */
-        gdt_create(gdt_entries + 0, 0, 0, 0, 0);                
+        gdt_create(entries + 0, 0, 0, 0, 0);                
 
         gdt_flag_t flag = GDT_SIZE | GDT_GRAN; /* same flag for 4 of them */
         gdt_access_t access[] = {
@@ -56,12 +56,28 @@ gdt_init(void)
         };
 
         for (int i = 1; i <= 4; ++i)
-                gdt_create(gdt_entries + i, 0, 0xFFFFF, flag, access[i - 1]);
+                gdt_create(entries + i, 0, 0xFFFFF, flag, access[i - 1]);
 
         /* task state segment */
-        tss = kmalloc(sizeof(tss_t));
         gdt_access_t tss_access = GDT_ACCESS | GDT_EXEC | GDT_DPL0 | GDT_PRESENT;
-        gdt_create(gdt_entries + 5, (uintptr_t) tss, sizeof(tss_t) - 1, 0, tss_access);
+        gdt_create(entries + 5, (uintptr_t) cpu_tss, sizeof(tss_t) - 1, 0, tss_access);
+
+        /* never loaded in a segment register, only read with lsl,
+           DPL3 because user tasks are kernel code that use it too */
+        gdt_access_t cpu_access = GDT_RW | GDT_TYPE | GDT_DPL3 | GDT_PRESENT;
+        gdt_create(entries + GDT_CPU_ENTRY, 0, cpu_id, 0, cpu_access);
+
+        return ptr;
+}
+        
+void
+gdt_init(void)
+{
+        kprintf("[GDT] setup STARTING\n");
+
+        tss = kmalloc(sizeof(tss_t));
+        gdt_ptr = gdt_cpu_create(tss, 0);
+        gdt_entries = (gdt_entry_t*) gdt_ptr->offset;
                
         gdt_flush(gdt_ptr);
 
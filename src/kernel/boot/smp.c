@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <kernel/smp.h>
+#include <kernel/apic.h>
+#include <kernel/gdt.h>
+#include <kernel/tss.h>
+#include <kernel/idt.h>
+#include <kernel/page.h>
+#include <kernel/hpet.h>
+#include <kernel/vmm.h>
+#include <kernel/task.h>
+#include <kernel/syscall.h>
+#include <kernel/fpu.h>
+#include <kernel/memory.h>
+#include <kernel/debug.h>
+
+/* kernel/boot/ap_boot.S */
+extern char ap_trampoline[];
+extern char ap_trampoline_end[];
+extern uint32_t ap_page_dir;
+extern uint32_t ap_stack;
+
+cpu_t cpus[CPU_MAX];
+uint32_t cpu_count = 1;
+
+/* processors are started one at a time */
+static cpu_t *ap_booting;
+
+void
+smp_add_cpu(uint32_t apic_id, int is_bsp)
+{
+        if (is_bsp) {
+                cpus[0].apic_id = apic_id;
+                return;
+        }
+
+        if (cpu_count == CPU_MAX) {
+                kprintf("[SMP] too many cpus, apic id %d ignored\n", apic_id);
+                return;
+        }
+
+        cpus[cpu_count].id = cpu_count;
+        cpus[cpu_count].apic_id = apic_id;
+        ++cpu_count;
+}
+
+static void
+smp_delay(uint64_t ns)
+{
+        uint64_t end = hpet_get_ns() + ns;
+        while (hpet_get_ns() < end);
+}
+
+/* everything the processor needs is allocated by the BSP, once it's
+   started it becomes the idle task of the processor and takes tasks
+   from the other run queues */
+void
+ap_main(void)
+{
+        cpu_t *cpu = ap_booting;
+
+        gdt_flush(cpu->gdt_ptr);
+        tss_flush();
+        idt_flush(idt_ptr);
+        syscall_cpu_init(cpu->tss->esp0);
+        lapic_ap_init();
+        fpu_cpu_init();
+
+        cpu->task = cpu->idle;
+        cpu->started = 1;
+
+        STI();
+        task_idle();
+}
+
+static int
+smp_start_cpu(cpu_t *cpu)
+{
+        cpu->tss = kmalloc(sizeof(tss_t));
+        tss_setup(cpu->tss);
+        cpu->gdt_ptr = gdt_cpu_create(cpu->tss, cpu->id);
+        cpu->idle = task_cpu_create("idle");
+        cpu->idle->cpu = cpu->id;
+
+        ap_booting = cpu;
+        *(uint32_t*)(AP_TRAMPOLINE_ADDR + ((char*)&ap_stack - ap_trampoline)) =
+                (uintptr_t) kmalloc(PAGE_FRAME_SIZE) + PAGE_FRAME_SIZE;
+
+        /* INIT, then two startup ipis as the MP specification says */
+        lapic_send_ipi(cpu->apic_id, LAPIC_ICR_INIT);
+        smp_delay(10000000);
+
+        for (int i = 0; i < 2 && !cpu->started; ++i) {
+                lapic_send_ipi(cpu->apic_id, LAPIC_ICR_STARTUP | (AP_TRAMPOLINE_ADDR >> 12));
+                smp_delay(200000);
+        }
+
+        uint64_t timeout = hpet_get_ns() + AP_STARTUP_TIMEOUT;
+        while (!cpu->started && hpet_get_ns() < timeout);
+
+        return cpu->started ? 0 : -1;
+}
+
+void
+smp_init(void)
+{
+        kprintf("[SMP] setup STARTING\n");
+
+        cpus[0].started = 1;
+
+        /* the trampoline is copied in the identity mapped lower memory */
+        ap_page_dir = kernel_page_dir;
+        memcpy((void*)AP_TRAMPOLINE_ADDR, ap_trampoline, ap_trampoline_end - ap_trampoline);
+
+        uint32_t started = 1;
+        for (uint32_t i = 1; i < cpu_count; ++i) {
+                if (smp_start_cpu(cpus + i)) {
+                        kprintf("[SMP] cpu %d (apic id %d) didn't start\n", i, cpus[i].apic_id);
+                        continue;
+                }
+
+                kprintf("[SMP] cpu %d (apic id %d) started\n", i, cpus[i].apic_id);
+                ++started;
+        }
+
+        kprintf("[SMP] %d cpus running\n", started);
+        kprintf("[SMP] setup COMPLETE\n");
+}
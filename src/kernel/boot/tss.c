@@ -4,23 +4,34 @@
 #include <kernel/tss.h>
 #include <kernel/vmm.h>
 #include <kernel/memory.h>
+#include <kernel/smp.h>
 
 tss_t *tss;
 
+/* the task state segment is loaded by tss_flush on its own cpu */
 void
-tss_init(void)
+tss_setup(tss_t *cpu_tss)
 {
-        kprintf("[TSS] setup STARTING\n");
-
-        memset(tss, 0, sizeof(tss_t));
+        memset(cpu_tss, 0, sizeof(tss_t));
         uint8_t *stack = kmalloc(PAGE_FRAME_SIZE);
         
         /* kernel data segment (third entry) */
-        tss->ss0 = 0x10;
-        tss->esp0 = (uintptr_t) stack + PAGE_LAST_DWORD;
-        tss->iopb = sizeof(tss_t);
+        cpu_tss->ss0 = 0x10;
+        cpu_tss->esp0 = (uintptr_t) stack + PAGE_LAST_DWORD;
+        cpu_tss->iopb = sizeof(tss_t);
+}
+
+void
+tss_init(void)
+{
+        kprintf("[TSS] setup STARTING\n");
 
+        tss_setup(tss);
         tss_flush();
+
+        /* the BSP is always the first cpu */
+        cpus[0].tss = tss;
+        cpus[0].gdt_ptr = gdt_ptr;
         
         kprintf("[TSS] setup COMPLETE\n");
 }
@@ -74,14 +74,14 @@ hpet_parse(void)
         hpet_header_t *hpet_header = (hpet_header_t*) rsdt_get_entry("HPET");
 
         hpet_addr = (uintptr_t)hpet_header->address.address;
-        page_identity_map(page_directory, hpet_addr, HPET_REGS_SIZE);
+        page_identity_map_mmio(page_directory, hpet_addr, HPET_REGS_SIZE);
 
         timers = HPET_N_OF_TIMERS + 1;
         uintptr_t start = (uintptr_t) hpet_get_timer_reg(HPET_TIMER_REG_CAP, 0);
         uintptr_t end = (uintptr_t) hpet_get_timer_reg(HPET_TIMER_REG_CAP, timers);
 
         for (; start < end; start += HPET_TIMER_OFFSET)
-                page_identity_map(page_directory, start, HPET_TIMER_SIZE);
+                page_identity_map_mmio(page_directory, start, HPET_TIMER_SIZE);
 }
 
 static int32_t
@@ -140,6 +140,22 @@ hpet_create_timer(uint32_t timer, uint32_t irq, void(*handler)(interrupt_frame_t
         kprintf("[HPET] apic_irq: %x\n", apic_irq);
 }
 
+/* absolute deadline, in one shot mode the timer fires
+   when the main counter reaches it */
+void
+hpet_set_deadline(uint32_t timer, uint64_t ns)
+{
+        *hpet_get_timer_reg(HPET_TIMER_REG_COMP, timer) = ns / period_ns;
+}
+
+/* level triggered timers keep the interrupt active until
+   their status bit is cleared, writing 1 clears it */
+void
+hpet_timer_ack(uint32_t timer)
+{
+        *hpet_get_reg(HPET_REG_INT_STAT) = 1 << timer;
+}
+
 uint64_t
 hpet_read_counter(void)
 {
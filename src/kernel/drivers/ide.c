@@ -12,15 +12,11 @@
 #include <kernel/idt.h>
 #include <kernel/vmm.h>
 #include <kernel/task.h>
+#include <kernel/page.h>
 
 ide_channel_t channels[2];
 ide_device_t ide_devices[4];
-prd_entry_t *prd_table;
-disk_request_t actual_disk_req;
-
-struct {
-        uint8_t buffer[KIB(1)];
-} __attribute__ ((packed)) *ide_mem_buffer;
+prd_entry_t *prd_table;         /* the tables of both channels */
 
 static uint8_t is_ide_set = 0;
 static uint8_t ide_buffer[1024] = {0};
@@ -200,39 +196,79 @@ ide_set_prdt(uint32_t channel, uintptr_t prdt_addr)
         outl(prdt_addr, channels[channel].bus_master_addr + 0x4);
 }
 
-static void
-ide_set_prd_entry(uint32_t prdt_entry, size_t size)
+static inline uint32_t
+ide_prd_size(prd_entry_t *entry)
 {
-        prd_table[prdt_entry].phys_addr = VIR2PHY((uintptr_t)&ide_mem_buffer[prdt_entry]);
-        prd_table[prdt_entry].byte_count = (size == KIB(64)) ? 0 : size;
-        prd_table[prdt_entry].reserved = 0;
+        return (entry->byte_count) ? entry->byte_count : KIB(64);
 }
 
-static void
-ide_fill_prd_table(ide_device_t *device, uint8_t *buffer, size_t size, int is_write)
+/* the regions are the physical pages of the buffer, a region is
+   merged with the previous one if they are contiguous and they don't
+   cross a 64 KiB boundary together. Returns the entries in use */
+static uint32_t
+ide_add_prd_entries(prd_entry_t *table, uint32_t count, uint8_t *buffer, size_t size)
 {
-        ide_set_prdt(device->channel, VIR2PHY((uintptr_t)prd_table));
-
-        uint32_t count = 0, start = 0;
-        while (size - start) {
-                size_t prd_size = (size > KIB(1)) ? KIB(1) : size;
-                
-                ide_set_prd_entry(count, prd_size);
-                if (is_write) memcpy(ide_mem_buffer[count].buffer, &buffer[start], prd_size);
+        uintptr_t addr = (uintptr_t)buffer, end = addr + size;
+        while (addr < end) {
+                uintptr_t next = (addr & ~(PAGE_FRAME_SIZE - 1)) + PAGE_FRAME_SIZE;
+                uint32_t len = ((next < end) ? next : end) - addr;
+
+                /* ide_submit already touched the page */
+                uintptr_t phys = page_get_phys_addr(page_directory, addr);
+
+                prd_entry_t *last = table + count - 1;
+                if (count && last->phys_addr + ide_prd_size(last) == phys &&
+                    last->phys_addr / IDE_PRD_BOUNDARY == (phys + len - 1) / IDE_PRD_BOUNDARY) {
+                        last->byte_count = (ide_prd_size(last) + len) % KIB(64);
+                } else {
+                        if (count == IDE_PRD_ENTRIES) {
+                                printf("[IDE] transfer doesn't fit in the prd table\n");
+                                abort();
+                        }
+
+                        table[count++] = (prd_entry_t) {
+                                .phys_addr  = phys,
+                                .byte_count = len,
+                                .reserved   = 0,
+                        };
+                }
 
-                ++count;
-                start += prd_size;
+                addr += len;
         }
-        prd_table[count - 1].reserved |= (1 << 15); 
-       
-        ide_write(device->channel, IDE_REG_BUS_COM, (is_write) ? 1 << 3 : 0);
-        ide_write(device->channel, IDE_REG_BUS_COM, 1);       
+
+        return count;
 }
 
-void
-ide_read_disk_buffer(void *buffer, size_t offset, size_t size)
+/* the data goes straight to the buffers of the merged requests,
+   there isn't any copy */
+static void
+ide_fill_prd_table(ide_device_t *device, ide_request_t *requests, int is_write)
+{
+        prd_entry_t *table = channels[device->channel].prd_table;
+        ide_set_prdt(device->channel, VIR2PHY((uintptr_t)table));
+
+        uint32_t count = 0;
+        for (ide_request_t *req = requests; req; req = req->next)
+                for (uint32_t i = 0; i < req->sg_count; ++i)
+                        count = ide_add_prd_entries(table, count, req->sg[i].buffer,
+                                                    req->sg[i].size);
+        table[count - 1].reserved |= IDE_PRD_LAST;
+
+        /* the direction is the one of the bus master, it writes the
+           memory when the disk is read */
+        uint8_t command = (is_write) ? 0 : 1 << 3;
+        ide_write(device->channel, IDE_REG_BUS_COM, command);
+        ide_write(device->channel, IDE_REG_BUS_COM, command | 1);       
+}
+
+/* a drive shows its status 400 ns after it's selected, reading the
+   alternate status takes 100 ns. Commands are started by the interrupt
+   handler too, it can't sleep */
+static inline void
+ide_delay(uint32_t channel)
 {
-        memcpy(buffer, (uint8_t*)(ide_mem_buffer->buffer) + offset, size);      
+        for (int i = 0; i < 4; ++i)
+                ide_read(channel, IDE_REG_ALTSTATUS);
 }
 
 static void
@@ -241,7 +277,7 @@ ide_set_device(ide_device_t *device, size_t lba, size_t sectors)
         uint8_t head = (lba > 0x10000000) ? 0 : (lba >> 24) & 0xF;
 
         ide_write(device->channel, IDE_REG_HDDEVSEL, 0xE0 | (device->drive << 4) | head);
-        sleep(1);
+        ide_delay(device->channel);
         
         ide_write(device->channel, IDE_REG_FEATURES, 0);
         while (~ide_read(device->channel, IDE_REG_STATUS) & (1 << 6));
@@ -262,18 +298,17 @@ ide_set_device(ide_device_t *device, size_t lba, size_t sectors)
 }
 
 static void
-ide_access_disk(ide_device_t *device, uint8_t *buffer, size_t lba,
-                size_t size, int is_write)
+ide_start_command(ide_device_t *device, ide_request_t *requests, size_t size)
 {
-        if (!size)
-                return;
+        size_t lba = requests->lba;
+        int is_write = requests->is_write;
 
-        actual_disk_req = (disk_request_t) {
-                .device = device,
-                .task   = current_task,
+        channels[device->channel].request = (disk_request_t) {
+                .device   = device,
+                .requests = requests,
         };
 
-        ide_fill_prd_table(device, buffer, size, is_write);
+        ide_fill_prd_table(device, requests, is_write);
 
         while (~ide_read(device->channel, IDE_REG_STATUS) & (1 << 6));
         ide_set_device(device, lba, (size - 1) / 512 + 1);
@@ -293,35 +328,196 @@ ide_access_disk(ide_device_t *device, uint8_t *buffer, size_t lba,
         }
 
         ide_write(device->channel, IDE_REG_COMMAND, command);
+}
+
+/* C-LOOK, the head only moves up: the first request at or after the
+   end of the last command, the lowest one when there isn't any */
+static ide_request_t**
+ide_pick(ide_device_t *device)
+{
+        ide_request_t **link = &device->queue;
+        for (; *link; link = &(*link)->next)
+                if ((*link)->lba >= device->next_lba)
+                        return link;
+
+        return &device->queue;
+}
+
+/* called with the lock of the channel held when it's idle, its drives
+   take turns if both have pending requests. The requests that go on
+   where the command ends are merged in it */
+static void
+ide_start(uint32_t channel)
+{
+        ide_device_t *device = NULL;
+        for (uint32_t i = 1; i <= 2 && !device; ++i) {
+                uint32_t drive = (channels[channel].last_drive + i) % 2;
+                if (ide_devices[channel * 2 + drive].queue) {
+                        device = ide_devices + channel * 2 + drive;
+                        channels[channel].last_drive = drive;
+                }
+        }
+
+        if (!device)
+                return;
+
+        ide_request_t **link = ide_pick(device);
+        ide_request_t *first = *link, *last = first, *next = first->next;
+        size_t size = first->size;
+        uint32_t pages = first->pages;
+
+        for (; next; last = next, next = next->next) {
+                if (next->is_write != first->is_write || size % SECTOR_SIZE ||
+                    next->lba != first->lba + size / SECTOR_SIZE ||
+                    size + next->size > IDE_MAX_TRANSFER ||
+                    pages + next->pages > IDE_PRD_ENTRIES)
+                        break;
+
+                size += next->size;
+                pages += next->pages;
+        }
+
+        *link = next;
+        last->next = NULL;
+
+        device->next_lba = first->lba + (size - 1) / SECTOR_SIZE + 1;
+        ide_start_command(device, first, size);
+}
+
+/* pages the piece spans, they are touched so that the list heap, which
+   is mapped on demand, gives them a frame before the transfer */
+static uint32_t
+ide_sg_pages(ide_sg_t *sg)
+{
+        uintptr_t addr = (uintptr_t)sg->buffer & ~(PAGE_FRAME_SIZE - 1);
+        uintptr_t end = (uintptr_t)sg->buffer + sg->size;
+
+        uint32_t pages = 0;
+        for (; addr < end; addr += PAGE_FRAME_SIZE, ++pages)
+                (void) *(volatile uint8_t*)addr;
+
+        return pages;
+}
+
+/* the request is queued and it's started right away if its channel
+   is idle, the caller waits for it with ide_wait */
+void
+ide_submit(ide_request_t *req)
+{
+        req->size = 0;
+        req->pages = 0;
+        for (uint32_t i = 0; i < req->sg_count; ++i) {
+                req->size += req->sg[i].size;
+                req->pages += ide_sg_pages(req->sg + i);
+        }
+
+        req->task = NULL;
+        req->done = !req->size;
+        if (req->done)
+                return;
+
+        if (req->size > IDE_MAX_TRANSFER || req->pages > IDE_PRD_ENTRIES) {
+                printf("[IDE] transfer of %d bytes is too big\n", req->size);
+                abort();
+        }
+
+        ide_device_t *device = ide_devices + req->device;
+        ide_channel_t *channel = channels + device->channel;
+        uint32_t flags = spin_lock_irqsave(&channel->lock);
+
+        ide_request_t **link = &device->queue;
+        for (; *link && (*link)->lba <= req->lba; link = &(*link)->next);
+        req->next = *link;
+        *link = req;
 
-        task_block(IO_REQUEST);
+        if (!channel->request.device)
+                ide_start(device->channel);
+
+        spin_unlock_irqrestore(&channel->lock, flags);
+}
+
+/* the interrupt can complete the request on another cpu before the
+   task sleeps, the state is set with the lock held so the wake up
+   can't be missed */
+void
+ide_wait(ide_request_t *req)
+{
+        spinlock_t *lock = &channels[ide_devices[req->device].channel].lock;
+        uint32_t flags = spin_lock_irqsave(lock);
+        if (req->done) {
+                spin_unlock_irqrestore(lock, flags);
+                return;
+        }
+
+        req->task = current_task;
+        current_task->state = IO_REQUEST;
+        spin_unlock_irqrestore(lock, flags);
+
+        task_wait();
+}
+
+static void
+ide_access_disk(uint8_t device_idx, ide_sg_t *sg, uint32_t count,
+                size_t addr, int is_write)
+{
+        ide_request_t req = {
+                .device   = device_idx,
+                .is_write = is_write,
+                .lba      = addr / SECTOR_SIZE,
+                .sg       = sg,
+                .sg_count = count,
+        };
+
+        ide_submit(&req);
+        ide_wait(&req);
+}
+
+void
+ide_write_disk_sg(uint8_t device_idx, ide_sg_t *sg, uint32_t count, size_t addr)
+{
+        ide_access_disk(device_idx, sg, count, addr, 1);
+}
+
+void
+ide_read_disk_sg(uint8_t device_idx, ide_sg_t *sg, uint32_t count, size_t addr)
+{
+        ide_access_disk(device_idx, sg, count, addr, 0);
 }
 
 void
 ide_write_disk(uint8_t device_idx, void *buffer, size_t addr, size_t size)
 {
-        ide_access_disk(ide_devices + device_idx, (uint8_t*)buffer, addr / 512, size, 1);
+        ide_sg_t sg = { .buffer = buffer, .size = size };
+        ide_write_disk_sg(device_idx, &sg, 1, addr);
 }        
 
 void
-ide_read_disk(uint8_t device_idx, size_t addr, size_t size)
+ide_read_disk(uint8_t device_idx, void *buffer, size_t addr, size_t size)
 {
-        ide_access_disk(ide_devices + device_idx, NULL, addr / 512, size, 0);
+        ide_sg_t sg = { .buffer = buffer, .size = size };
+        ide_read_disk_sg(device_idx, &sg, 1, addr);
 }
 
-__attribute__ ((interrupt))
+/* the requests of the command that has completed are marked as done
+   and the next command of the channel is started */
 static void
-ide_handler(interrupt_frame_t *frame)
+ide_handler(uint32_t channel)
 {
-        (void) frame;
-        
-        ide_device_t *device = actual_disk_req.device;
+        spin_lock(&channels[channel].lock);
+
+        ide_device_t *device = channels[channel].request.device;
+        if (!device) {
+                spin_unlock(&channels[channel].lock);
+                lapic_sendEOI();
+                return;
+        }
 
-        uint32_t bus_stat = ide_read(device->channel, IDE_REG_BUS_STAT);
-        uint32_t reg_stat = ide_read(device->channel, IDE_REG_STATUS);
-        ide_write(device->channel, IDE_REG_BUS_STAT, (1 << 2));
+        uint32_t bus_stat = ide_read(channel, IDE_REG_BUS_STAT);
+        uint32_t reg_stat = ide_read(channel, IDE_REG_STATUS);
+        ide_write(channel, IDE_REG_BUS_STAT, (1 << 2));
 
         if (~bus_stat & (1 << 2)) {
+                spin_unlock(&channels[channel].lock);
                 lapic_sendEOI();
                 return;
         }
@@ -330,10 +526,51 @@ ide_handler(interrupt_frame_t *frame)
                 kprintf("[IDE] error in data transfer\n");
         }
         
-        ide_write(device->channel, IDE_REG_BUS_COM, 0);
-        task_unblock(actual_disk_req.task);
+        ide_write(channel, IDE_REG_BUS_COM, 0);
+
+        /* a request can be gone as soon as it's done, the tasks to
+           wake up are linked through their next field */
+        task_info_t *tasks = NULL;
+        ide_request_t *req = channels[channel].request.requests;
+        while (req) {
+                ide_request_t *next = req->next;
+                if (req->task) {
+                        req->task->next = tasks;
+                        tasks = req->task;
+                }
 
+                req->done = 1;
+                req = next;
+        }
+
+        channels[channel].request.device = NULL;
+        ide_start(channel);
+        spin_unlock(&channels[channel].lock);
+
+        /* the unblocked tasks can preempt the current one, so the
+           EOI has to be sent first */
         lapic_sendEOI();
+        while (tasks) {
+                task_info_t *task = tasks;
+                tasks = task->next;
+                task_unblock(task);
+        }
+}
+
+__attribute__ ((interrupt))
+static void
+ide_primary_handler(interrupt_frame_t *frame)
+{
+        (void) frame;
+        ide_handler(IDE_PRIMARY);
+}
+
+__attribute__ ((interrupt))
+static void
+ide_secondary_handler(interrupt_frame_t *frame)
+{
+        (void) frame;
+        ide_handler(IDE_SECONDARY);
 }
 
 static void
@@ -345,7 +582,10 @@ ide_setup_int(uint32_t channel, uint32_t irq)
         ioapic_legacy_irq_activate(irq);
 
         idt_flag_t flag = IDT_PRESENT | IDT_32B_INT; 
-        idt_create(idt_entries + IRQ_OFFSET + irq, (uintptr_t) ide_handler, flag);
+        uintptr_t handler = (channel == IDE_PRIMARY) ?
+                (uintptr_t) ide_primary_handler :
+                (uintptr_t) ide_secondary_handler;
+        idt_create(idt_entries + IRQ_OFFSET + irq, handler, flag);
 }
 
 static void
@@ -363,6 +603,9 @@ ide_init(void)
                 return;
         }
 
+        for (uint32_t channel = 0; channel < 2; ++channel) 
+                channels[channel].prd_table = prd_table + channel * IDE_PRD_ENTRIES;
+
         for (uint32_t channel = 0; channel < 2; ++channel) 
                 for (uint32_t drive = 0; drive < 2; ++drive) 
                         ide_detect_drive(channel, drive);
@@ -7,23 +7,44 @@
 #include <kernel/mutex.h>
 #include <kernel/ide.h>
 #include <kernel/vmm.h>
+#include <kernel/slab.h>
+#include <kernel/task.h>
+#include <kernel/hpet.h>
 
+/* lookups only take the lock for reading and don't touch the free
+   list, an entry that got a new reference stays on the list and is
+   dropped from it when it reaches the tail. A count only goes to 0
+   with the lock held for writing, so a buffer can't be evicted while
+   its last user releases it */
 struct {
+        kmem_cache_t *cache;
         hash_table_t *table;
-        semaphore_t *mutex;
+        rwsem_t rwsem;         /* table and free list */
         bio_buf_t *lhead;
         bio_buf_t *ltail;
+        task_info_t *flusher;
+        task_info_t *readahead;
+        mutex_t *ra_mutex;             /* read ahead queue */
+        wait_queue_t ra_wait;
+        bio_ra_t ra_queue[BIO_RA_QUEUE_SIZE];
+        uint32_t ra_read;
+        uint32_t ra_write;
 } bio_head;
 
+static void bio_flush(uint64_t older_than, int free_only);
+
 static bio_buf_t*
 bio_alloc(int device, uint32_t block, uint32_t size)
 {
-        bio_buf_t *buf = kmalloc(sizeof(bio_buf_t));
+        bio_buf_t *buf = kmem_cache_alloc(bio_head.cache);
         buf->device = device;
         buf->block = block;
         buf->ref_count = 1;
         buf->valid = 0;
-        buf->mutex = mutex_create();
+        buf->dirty = 0;
+        buf->dirty_time = 0;
+        /* a low priority task can hold a buffer during the whole disk access */
+        buf->mutex = mutex_pi_create();
         buf->size = size;
         buf->buffer = kmalloc(size);
         buf->next = NULL;
@@ -32,56 +53,79 @@ bio_alloc(int device, uint32_t block, uint32_t size)
         return buf;
 }
 
+static inline int
+bio_listed(bio_buf_t *buf)
+{
+        return buf->prev || bio_head.lhead == buf;
+}
+
 static void
 bio_remove(bio_buf_t *buf)
 {
-        if (!buf->next && !buf->prev) {
+        if (!bio_listed(buf)) {
                 printf("[BIO] buffer not part of list\n");
                 abort();
         }
         
-        if (!bio_head.lhead && !bio_head.ltail) {
-                printf("[BIO] removing from empty list\n");
-                abort();
-        }
-        
-        if (buf == bio_head.lhead) {
-
+        if (buf->prev)
+                buf->prev->next = buf->next;
+        else
                 bio_head.lhead = buf->next;
-                buf->next->prev = NULL;
-                
-        }
-
-        if (buf == bio_head.ltail) {
 
+        if (buf->next)
+                buf->next->prev = buf->prev;
+        else
                 bio_head.ltail = buf->prev;
-                buf->prev->next = NULL;
-                
-        }
 
-        if (buf != bio_head.ltail && buf != bio_head.lhead) {
+        buf->next = NULL;
+        buf->prev = NULL;
+}
 
-                buf->prev->next = buf->next;
-                buf->next->prev = buf->prev;
-                
-        }
+/* the most recently released buffer goes to the head */
+static void
+bio_push(bio_buf_t *buf)
+{
+        if (bio_listed(buf))
+                bio_remove(buf);
+
+        if (!bio_head.lhead)
+                bio_head.ltail = buf;
+        else
+                bio_head.lhead->prev = buf;
+
+        buf->next = bio_head.lhead;
+        bio_head.lhead = buf;
 }
 
 static void
+bio_free(bio_buf_t *buf)
+{
+        kfree(buf->buffer);
+        mutex_free(buf->mutex);
+        kmem_cache_free(bio_head.cache, buf);
+}
+
+/* the evicted buffer is freed by the caller once the lock is released,
+   dirty buffers have to be written back first, NULL is returned if
+   every free buffer is dirty */
+static bio_buf_t*
 bio_evict(void)
 {
+        /* buffers that are used again leave the list only here */
+        while (bio_head.ltail && bio_head.ltail->ref_count)
+                bio_remove(bio_head.ltail);
+
         if (!bio_head.ltail) {
                 bio_debug_print();
                 printf("[BIO] there aren't any free bufs\n");
                 abort();
         }
-        
-        if (bio_head.ltail->ref_count) {
-                printf("[BIO] buf shouldn't be already free\n");
-                abort();
-        }
 
         bio_buf_t *old = bio_head.ltail;
+        for (; old && (old->ref_count || old->dirty); old = old->prev);
+
+        if (!old)
+                return NULL;
 
         hash_key_t key = {((uint64_t)old->device << 32) | old->block};
         if (ht_remove(bio_head.table, key)) {
@@ -90,75 +134,120 @@ bio_evict(void)
         }
         
         bio_remove(old);
-        kfree(old->buffer);
-        kfree(old->mutex);
-        kfree(old);
+        return old;
 }
 
-bio_buf_t*
-bio_get(int device, uint32_t block, uint32_t size)
+static bio_buf_t*
+bio_lookup(hash_key_t key, uint32_t size)
 {
-        mutex_acquire(bio_head.mutex);
-        
-        hash_key_t key = {((uint64_t)device << 32) | block}; 
         bio_buf_t *buf = ht_get(bio_head.table, key);
+        if (!buf)
+                return NULL;
 
-        if (buf) {
-                /* TODO: TEMPORARY SOLUTION */
-                if (size != buf->size) {
-                        printf("[BIO] buf size and required size differ\n");
-                        abort();
-                }
-                
-                if (!buf->ref_count++)
-                        bio_remove(buf);
-               
-                mutex_release(bio_head.mutex);
-                mutex_acquire(buf->mutex);
-                return buf;
+        /* TODO: TEMPORARY SOLUTION */
+        if (size != buf->size) {
+                printf("[BIO] buf size and required size differ\n");
+                abort();
         }
 
-        buf = bio_alloc(device, block, size);
-        
-        if (!ht_set(bio_head.table, key, buf)) {
-                mutex_release(bio_head.mutex);
+        __atomic_add_fetch(&buf->ref_count, 1, __ATOMIC_ACQ_REL);
+        return buf;
+}
+
+/* a new buffer is allocated without the lock, if another task added
+   the same block in the meantime the new one is thrown away. With
+   only_new set NULL is returned instead of a buffer already cached */
+static bio_buf_t*
+bio_find(int device, uint32_t block, uint32_t size, int only_new)
+{
+        hash_key_t key = {((uint64_t)device << 32) | block}; 
+
+        rwsem_down_read(&bio_head.rwsem);
+        bio_buf_t *buf = only_new ? ht_get(bio_head.table, key) : bio_lookup(key, size);
+        rwsem_up_read(&bio_head.rwsem);
+
+        if (buf) {
+                if (only_new)
+                        return NULL;
+
                 mutex_acquire(buf->mutex);
                 return buf;
         }
 
-        int ret;
-        do {
-                bio_evict();
-                ret = ht_set(bio_head.table, key, buf);
-        } while (ret && bio_head.ltail);
-        
-        if (!ret) {
-                mutex_release(bio_head.mutex);
-                mutex_acquire(buf->mutex);
-                return buf;
+        /* nobody can see it yet, taking it doesn't wait */
+        bio_buf_t *new = bio_alloc(device, block, size);
+        mutex_acquire(new->mutex);
+
+        for (;;) {
+                rwsem_down_write(&bio_head.rwsem);
+
+                buf = only_new ? ht_get(bio_head.table, key) : bio_lookup(key, size);
+                if (buf) {
+                        rwsem_up_write(&bio_head.rwsem);
+                        mutex_release(new->mutex);
+                        bio_free(new);
+
+                        if (only_new)
+                                return NULL;
+
+                        mutex_acquire(buf->mutex);
+                        return buf;
+                }
+
+                /* least recently used buffers make room in the table */
+                bio_buf_t *evicted = NULL;
+                int full = 0;
+                while (ht_set(bio_head.table, key, new)) {
+                        bio_buf_t *old = bio_evict();
+                        if (!old) {
+                                full = 1;
+                                break;
+                        }
+
+                        old->next = evicted;
+                        evicted = old;
+                }
+
+                rwsem_up_write(&bio_head.rwsem);
+
+                while (evicted) {
+                        bio_buf_t *old = evicted;
+                        evicted = old->next;
+                        bio_free(old);
+                }
+
+                if (!full)
+                        break;
+
+                /* the caller can hold other buffers, only the free ones
+                   are written back */
+                bio_flush(BIO_FLUSH_ALL, 1);
         }
 
-        printf("[BIO] can't get any free buffer\n");
-        abort();
+        return new;
+}
+
+bio_buf_t*
+bio_get(int device, uint32_t block, uint32_t size)
+{
+        return bio_find(device, block, size, 0);
 }
 
 void
 bio_release(bio_buf_t *buf)
 {
-        mutex_acquire(bio_head.mutex);
+        mutex_release(buf->mutex);
 
-        if (!--buf->ref_count) {
-                if (!bio_head.lhead)
-                        bio_head.ltail = buf;
-                else
-                        bio_head.lhead->prev = buf;
+        int count = __atomic_load_n(&buf->ref_count, __ATOMIC_RELAXED);
+        while (count > 1)
+                if (__atomic_compare_exchange_n(&buf->ref_count, &count, count - 1, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        return;
 
-                buf->next = bio_head.lhead;
-                bio_head.lhead = buf;
-        }
-        
-        mutex_release(bio_head.mutex);
-        mutex_release(buf->mutex);
+        rwsem_down_write(&bio_head.rwsem);
+        if (!__atomic_sub_fetch(&buf->ref_count, 1, __ATOMIC_ACQ_REL))
+                bio_push(buf);
+        rwsem_up_write(&bio_head.rwsem);
 }
 
 bio_buf_t*
@@ -166,19 +255,179 @@ bio_read(int device, uint32_t block, uint32_t size)
 {
         bio_buf_t *buf = bio_get(device, block, size);
         if (!buf->valid) {
-                ide_read_disk(device, block * size, size);
-                ide_read_disk_buffer(buf->buffer, 0, size);
+                ide_read_disk(device, buf->buffer, block * size, size);
                 buf->valid = 1;
         }
 
         return buf;
 }
 
+/* it's only a hint, the request is dropped if the queue is full */
+void
+bio_read_ahead(int device, uint32_t block, uint32_t count, uint32_t size)
+{
+        mutex_acquire(bio_head.ra_mutex);
+
+        if (bio_head.ra_write - bio_head.ra_read < BIO_RA_QUEUE_SIZE) {
+                bio_head.ra_queue[bio_head.ra_write++ % BIO_RA_QUEUE_SIZE] = (bio_ra_t) {
+                        .device = device,
+                        .block  = block,
+                        .count  = count,
+                        .size   = size,
+                };
+                wait_queue_wake_one(&bio_head.ra_wait);
+        }
+
+        mutex_release(bio_head.ra_mutex);
+}
+
+/* blocks already cached are skipped, the consecutive ones that aren't
+   are read with a single request straight into their buffers. All the
+   requests are queued before waiting, so the disk can sort them. A
+   reader of one of the blocks waits for its mutex until it's read */
+static void
+bio_prefetch(bio_ra_t *ra)
+{
+        uint32_t batch = IDE_MAX_TRANSFER / ra->size;
+        bio_buf_t **bufs = kmalloc(sizeof(bio_buf_t*) * ra->count);
+        ide_sg_t *sg = kmalloc(sizeof(ide_sg_t) * ra->count);
+        ide_request_t *reqs = kmalloc(sizeof(ide_request_t) * ra->count);
+
+        uint32_t count = 0, requests = 0;
+        for (uint32_t block = ra->block; block < ra->block + ra->count; ++block) {
+                bio_buf_t *buf = bio_find(ra->device, block, ra->size, 1);
+                if (!buf)
+                        continue;
+
+                ide_request_t *req = (requests) ? reqs + requests - 1 : NULL;
+                if (!req || bufs[count - 1]->block + 1 != block || req->sg_count == batch) {
+                        if (req)
+                                ide_submit(req);
+
+                        req = reqs + requests++;
+                        *req = (ide_request_t) {
+                                .device   = ra->device,
+                                .is_write = 0,
+                                .lba      = block * ra->size / SECTOR_SIZE,
+                                .sg       = sg + count,
+                                .sg_count = 0,
+                        };
+                }
+
+                sg[count].buffer = buf->buffer;
+                sg[count].size = buf->size;
+                ++req->sg_count;
+                bufs[count++] = buf;
+        }
+
+        if (requests)
+                ide_submit(reqs + requests - 1);
+
+        for (uint32_t i = 0; i < requests; ++i)
+                ide_wait(reqs + i);
+
+        for (uint32_t i = 0; i < count; ++i) {
+                bufs[i]->valid = 1;
+                bio_release(bufs[i]);
+        }
+
+        kfree(reqs);
+        kfree(sg);
+        kfree(bufs);
+}
+
+static void
+bio_readahead(void)
+{
+        for (;;) {
+                mutex_acquire(bio_head.ra_mutex);
+                while (bio_head.ra_read == bio_head.ra_write)
+                        wait_queue_wait(&bio_head.ra_wait, bio_head.ra_mutex);
+
+                bio_ra_t ra = bio_head.ra_queue[bio_head.ra_read++ % BIO_RA_QUEUE_SIZE];
+                mutex_release(bio_head.ra_mutex);
+
+                bio_prefetch(&ra);
+        }
+}
+
+/* the buffer is only marked dirty, it's written back by the flusher,
+   by bio_sync, or before it's evicted */
 void
 bio_write(bio_buf_t *buf)
 {
+        buf->valid = 1;
+        if (!buf->dirty) {
+                buf->dirty = 1;
+                buf->dirty_time = hpet_get_ns();
+        }
+}
+
+/* called with the mutex of the buffer held */
+static void
+bio_write_back(bio_buf_t *buf)
+{
+        if (!buf->dirty)
+                return;
+
         ide_write_disk(buf->device, buf->buffer, buf->block * buf->size, buf->size);
-        buf->valid = 0;
+        buf->dirty = 0;
+}
+
+/* buffers dirty since before older_than are written back, a reference
+   is taken while the table is read so they can't be evicted meanwhile */
+static void
+bio_flush(uint64_t older_than, int free_only)
+{
+        size_t capacity = bio_head.table->capacity;
+        bio_buf_t **bufs = kmalloc(sizeof(bio_buf_t*) * capacity);
+        uint32_t count = 0;
+
+        rwsem_down_read(&bio_head.rwsem);
+
+        hash_entry_t *entry = bio_head.table->entries;
+        for (size_t i = 0; i < capacity; ++i) {
+                if (entry[i].state != HT_VALID)
+                        continue;
+
+                bio_buf_t *buf = entry[i].value;
+                if (!buf->dirty || buf->dirty_time > older_than)
+                        continue;
+
+                if (free_only && buf->ref_count)
+                        continue;
+
+                __atomic_add_fetch(&buf->ref_count, 1, __ATOMIC_ACQ_REL);
+                bufs[count++] = buf;
+        }
+
+        rwsem_up_read(&bio_head.rwsem);
+
+        for (uint32_t i = 0; i < count; ++i) {
+                mutex_acquire(bufs[i]->mutex);
+                bio_write_back(bufs[i]);
+                bio_release(bufs[i]);
+        }
+
+        kfree(bufs);
+}
+
+void
+bio_sync(void)
+{
+        bio_flush(BIO_FLUSH_ALL, 0);
+}
+
+static void
+bio_flusher(void)
+{
+        for (;;) {
+                sleep(BIO_FLUSH_PERIOD);
+
+                uint64_t now = hpet_get_ns();
+                if (now > BIO_DIRTY_EXPIRE)
+                        bio_flush(now - BIO_DIRTY_EXPIRE, 0);
+        }
 }
 
 void
@@ -213,8 +462,19 @@ bio_debug_print(void)
 void
 bio_init(void)
 {
-        bio_head.mutex = mutex_create();
+        bio_head.cache = kmem_cache_create("bio_buf", sizeof(bio_buf_t));
+        rwsem_init(&bio_head.rwsem);
         bio_head.lhead = NULL;
         bio_head.ltail = NULL;
         bio_head.table = ht_create(BIO_TABLE_SIZE, BIO_LOAD_FACTOR, 0); 
+
+        bio_head.flusher = task_kernel_create_new(bio_flusher, "flusher");
+        task_add_node(bio_head.flusher);
+
+        bio_head.ra_mutex = mutex_create();
+        wait_queue_init(&bio_head.ra_wait);
+        bio_head.ra_read = 0;
+        bio_head.ra_write = 0;
+        bio_head.readahead = task_kernel_create_new(bio_readahead, "readahd");
+        task_add_node(bio_head.readahead);
 }
@@ -8,6 +8,7 @@
 #include <kernel/inode.h>
 #include <kernel/mutex.h>
 #include <kernel/vmm.h>
+#include <kernel/slab.h>
 
 struct dir_itf {
         int valid;
@@ -16,10 +17,14 @@ struct dir_itf {
         void (*parse_root)(int);
 };
 
+/* same scheme as the buffer cache, path lookups share the lock and
+   entries that are used again stay on the free list until they reach
+   its tail */
 static struct {
         struct dir_itf dir_itfs[4];
+        kmem_cache_t *cache;
         hash_table_t *table;
-        semaphore_t *mutex;
+        rwsem_t rwsem;         /* table and free list */
         dentry_t *lhead;
         dentry_t *ltail;
 } dir_head;
@@ -27,7 +32,7 @@ static struct {
 static dentry_t*
 dentry_alloc(char *path, inode_t *inode, uint32_t offset)
 {
-        dentry_t *dentry = kmalloc(sizeof(dentry_t));
+        dentry_t *dentry = kmem_cache_alloc(dir_head.cache);
         dentry->valid = 0;
         dentry->ref_count = 1;
         dentry->offset = offset;
@@ -48,52 +53,73 @@ dentry_alloc(char *path, inode_t *inode, uint32_t offset)
         return dentry;
 }
 
+static void
+dentry_free(dentry_t *dentry)
+{
+        mutex_free(dentry->mutex);
+        kfree(dentry->path);
+        ht_free(dentry->table);
+        kmem_cache_free(dir_head.cache, dentry);
+}
+
+static inline int
+dir_listed(dentry_t *dentry)
+{
+        return dentry->prev || dir_head.lhead == dentry;
+}
+
 static void
 dir_remove(dentry_t *dentry)
 {
-        if (!dentry->next && !dentry->prev && dir_head.lhead != dentry) {
+        if (!dir_listed(dentry)) {
                 printf("dentry->next: %x, dentry->prev: %x\n", dentry->next, dentry->prev);
                 printf("dentry->inode->n: %d\n", dentry->inode->n);
                 printf("[DENTRY] dentry not part of list\n");
                 abort();
         }
         
-        if (!dir_head.lhead && !dir_head.ltail) {
-                printf("[DENTRY] removing from empty list\n");
-                abort();
-        }
-        
-        if (dentry == dir_head.lhead) {
+        if (dentry->prev)
+                dentry->prev->next = dentry->next;
+        else
                 dir_head.lhead = dentry->next;
-                dentry->next->prev = NULL;
-        }
 
-        if (dentry == dir_head.ltail) {
+        if (dentry->next)
+                dentry->next->prev = dentry->prev;
+        else
                 dir_head.ltail = dentry->prev;
-                dentry->prev->next = NULL;
-        }
 
-        if (dentry != dir_head.ltail && dentry != dir_head.lhead) {
-                dentry->prev->next = dentry->next;
-                dentry->next->prev = dentry->prev;
-        }
+        dentry->next = NULL;
+        dentry->prev = NULL;
+}
+
+static void
+dir_push(dentry_t *dentry)
+{
+        if (dir_listed(dentry))
+                dir_remove(dentry);
+
+        if (!dir_head.lhead)
+                dir_head.ltail = dentry;
+        else
+                dir_head.lhead->prev = dentry;
+
+        dentry->next = dir_head.lhead;
+        dir_head.lhead = dentry;
 }
 
 /* HELPER FUNCTION */
 static dentry_t* 
 _dir_dup(dentry_t *dentry)
 {
-        ++dentry->ref_count;
+        __atomic_add_fetch(&dentry->ref_count, 1, __ATOMIC_ACQ_REL);
         return dentry;
 }
 
+/* the caller holds a reference, so the dentry can't be evicted */
 dentry_t*
 dir_dup(dentry_t *dentry)
 {
-        mutex_acquire(dir_head.mutex);
-        _dir_dup(dentry);
-        mutex_release(dir_head.mutex);
-        return dentry;
+        return _dir_dup(dentry);
 }
 
 void
@@ -107,30 +133,25 @@ dir_add_child(dentry_t *dir, dentry_t *entry)
         ht_set(dir->table, key, entry);
 
         entry->parent = _dir_dup(dir);
+        _dir_dup(entry);
 
         if (dir->children)
                 dir->children->prev_sib = entry;
         
         entry->next_sib = dir->children;
         entry->prev_sib = NULL;
-        dir->children = _dir_dup(entry);
+        dir->children = entry;
 }
 
-/* HELPER FUNCTION */
+/* HELPER FUNCTION, called with the lock held for writing */
 static void
 _dir_release(dentry_t *dentry)
 {
-        if (!--dentry->ref_count) {
-                if (!dir_head.lhead)
-                        dir_head.ltail = dentry;
-                else
-                        dir_head.lhead->prev = dentry;
-
-                dentry->next = dir_head.lhead;
-                dir_head.lhead = dentry;
-        }
+        if (!__atomic_sub_fetch(&dentry->ref_count, 1, __ATOMIC_ACQ_REL))
+                dir_push(dentry);
 }
 
+/* called with the lock held for writing */
 static void
 dir_release_entries(dentry_t *dentry)
 {
@@ -155,6 +176,7 @@ dir_remove_child(dentry_t *dir, dentry_t *entry)
                 entry->next_sib->prev_sib = entry->prev_sib;
         entry->next_sib = NULL;
 
+        rwsem_down_write(&dir_head.rwsem);
         _dir_release(entry->parent);
         entry->parent = NULL;
         _dir_release(entry);
@@ -165,37 +187,31 @@ dir_remove_child(dentry_t *dir, dentry_t *entry)
                 abort();
         }
 
-        kfree(entry->mutex);
-        kfree(entry->path);
-
         if (entry->valid) 
                 dir_release_entries(entry);
 
-        ht_free(entry->table);
-        kfree(entry);
+        rwsem_up_write(&dir_head.rwsem);
+        dentry_free(entry);
 }
 
 void
 dir_unlock(dentry_t *dentry)
 {
-        mutex_acquire(dir_head.mutex);
         mutex_release(dentry->mutex);
-        mutex_release(dir_head.mutex);
 }
 
-static void
+/* the evicted dentry is freed by the caller once the lock is released */
+static dentry_t*
 dir_evict(void)
 {
+        while (dir_head.ltail && dir_head.ltail->ref_count)
+                dir_remove(dir_head.ltail);
+
         if (!dir_head.ltail) {
                 printf("[DENTRY] there aren't any free dentries\n");
                 abort();
         }
 
-        if (dir_head.ltail->ref_count) {
-                printf("[DENTRY] dentry shouldn't be already free\n");
-                abort();
-        }
-
         dentry_t *old = dir_head.ltail;
 
         hash_key_t key = {.key32 = old->path};
@@ -205,22 +221,38 @@ dir_evict(void)
         }
 
         dir_remove(old);
-        kfree(old->mutex);
-        kfree(old->path);
 
         if (old->valid) 
                 dir_release_entries(old);
 
-        ht_free(old->table);
-        kfree(old);
+        return old;
 }
 
+/* only the last reference needs the lock */
 void
 dir_release(dentry_t *dentry)
 {
-        mutex_acquire(dir_head.mutex);
+        int count = __atomic_load_n(&dentry->ref_count, __ATOMIC_RELAXED);
+        while (count > 1)
+                if (__atomic_compare_exchange_n(&dentry->ref_count, &count, count - 1, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        return;
+
+        rwsem_down_write(&dir_head.rwsem);
         _dir_release(dentry);
-        mutex_release(dir_head.mutex);
+        rwsem_up_write(&dir_head.rwsem);
+}
+
+static dentry_t*
+dir_lookup(char *path)
+{
+        hash_key_t key = {.key32 = path};
+
+        rwsem_down_read(&dir_head.rwsem);
+        dentry_t *dentry = ht_get(dir_head.table, key);
+        rwsem_up_read(&dir_head.rwsem);
+
+        return dentry;
 }
 
 static dentry_t*
@@ -232,8 +264,7 @@ dir_iter_get(char *path, size_t len)
                 for (; path[len] != '/' && len; --len);
                 path[len] = 0;
                 
-                hash_key_t key = {.key32 = path};
-                dentry = ht_get(dir_head.table, key);
+                dentry = dir_lookup(path);
                 if (dentry)
                         break;
         }
@@ -243,10 +274,7 @@ dir_iter_get(char *path, size_t len)
 
         int (*parse_dir)(dentry_t *) = dir_head.dir_itfs[0].parse_dir;
         while (len != orig_len) {
-
-                mutex_release(dir_head.mutex);
                 parse_dir(dentry);
-                mutex_acquire(dir_head.mutex);
 
                 path[len] = '/';
                 for (; len != orig_len && path[len]; ++len);
@@ -263,8 +291,7 @@ dir_iter_get(char *path, size_t len)
                 if (orig_len > 1 && path[orig_len - 1] == '/') {
                     path[orig_len - 1] = 0;
                 }
-                hash_key_t key = {.key32 = path};
-                dentry = ht_get(dir_head.table, key);
+                dentry = dir_lookup(path);
                 if (!dentry) {
                         printf("[DENTRY] not existing dentry\n");
                         return NULL;
@@ -277,9 +304,7 @@ dir_iter_get(char *path, size_t len)
 void
 dir_lock(dentry_t *dentry)
 {
-        mutex_acquire(dir_head.mutex);
         mutex_acquire(dentry->mutex);
-        mutex_release(dir_head.mutex);
 }
 
 char*
@@ -301,8 +326,6 @@ dir_sum_path(void *path1, void *path2, size_t len1, size_t len2)
 dentry_t*
 dir_get(char *path)
 {
-        mutex_acquire(dir_head.mutex);
-
         int new_path_flag = 0;
         if (*path != '/') {
                 dentry_t *cur = current_task->current_dir;
@@ -314,24 +337,27 @@ dir_get(char *path)
         if (len > 1 && path[len - 1] == '/') path[len - 1] = '\0';
  
         hash_key_t key = {.key32 = path};
+        rwsem_down_read(&dir_head.rwsem);
         dentry_t *dentry = ht_get(dir_head.table, key);
 
         if (dentry) {
-                if (!dentry->ref_count++)
-                        dir_remove(dentry);
+                _dir_dup(dentry);
 
-                mutex_release(dir_head.mutex);
+                rwsem_up_read(&dir_head.rwsem);
                 if (new_path_flag)
                         kfree(path);
 
                 return dentry;
         }
 
+        rwsem_up_read(&dir_head.rwsem);
+
+        /* parsing directories sleeps, the lock is only taken to look
+           up every part of the path */
         char path_buf[len + 1];
         memcpy(path_buf, path, len + 1);
         dentry = dir_iter_get(path_buf, len);
         
-        mutex_release(dir_head.mutex);
         if (new_path_flag)
                 kfree(path);
 
@@ -341,30 +367,29 @@ dir_get(char *path)
 dentry_t*
 dir_set(int device, char *path, uint32_t inode_n, uint32_t offset)
 {
-        mutex_acquire(dir_head.mutex);
-        
         inode_t *inode = inode_get(device, inode_n);
         dentry_t *dentry = dentry_alloc(path, inode, offset);
 
         hash_key_t key = {.key32 = path};
-        if (!ht_set(dir_head.table, key, dentry)) {
-                mutex_release(dir_head.mutex);
-                return dentry;
+        rwsem_down_write(&dir_head.rwsem);
+
+        /* least recently used dentries make room in the table */
+        dentry_t *evicted = NULL;
+        while (ht_set(dir_head.table, key, dentry)) {
+                dentry_t *old = dir_evict();
+                old->next = evicted;
+                evicted = old;
         }
-        
-        int ret;
-        do {
-                dir_evict();
-                ret = ht_set(dir_head.table, key, dentry);
-        } while (ret && dir_head.ltail);
-
-        if (!ret) {
-                mutex_release(dir_head.mutex);
-                return dentry;
+
+        rwsem_up_write(&dir_head.rwsem);
+
+        while (evicted) {
+                dentry_t *old = evicted;
+                evicted = old->next;
+                dentry_free(old);
         }
-        
-        printf("[DENTRY] can't get any free dentry\n");
-        abort();
+
+        return dentry;
 }
 
 static dentry_t*
@@ -660,7 +685,8 @@ void dir_add_itf(int device,
 void
 dir_init(void)
 {
-        dir_head.mutex = mutex_create();
+        dir_head.cache = kmem_cache_create("dentry", sizeof(dentry_t));
+        rwsem_init(&dir_head.rwsem);
         dir_head.lhead = NULL;
         dir_head.ltail = NULL;
         dir_head.table = ht_create(DIR_TABLE_SIZE, DIR_LOAD_FACTOR, HT_PTRKEY);
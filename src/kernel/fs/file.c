@@ -10,36 +10,28 @@
 #include <kernel/filesystem.h>
 #include <kernel/pipe.h>
 #include <kernel/syscall.h>
+#include <kernel/slab.h>
 
 struct {
-        semaphore_t *mutex;
-        file_t *flist;
-        file_t *ulist;
+        kmem_cache_t *cache;
+        mutex_t *mutex;
 } fhead;
 
 file_t*
 file_alloc(void)
 {
-        mutex_acquire(fhead.mutex);
-
-        file_t *file;
-        if (fhead.flist) {
-                file = fhead.flist;
-                fhead.flist = file->next;
-        } else {
-                file = kmalloc(sizeof(file_t)); 
-        }
+        file_t *file = kmem_cache_alloc(fhead.cache);
+        if (!file)
+                return NULL;
         
         file->ref_count = 1;
-        file->next = fhead.ulist;
-        fhead.ulist = file;
+        file->next = NULL;
 
         file->close = NULL;
         file->read = NULL;
         file->write = NULL;
         file->stat = NULL;
         
-        mutex_release(fhead.mutex);
         return file;
 }
 
@@ -63,13 +55,14 @@ file_close(file_t *file)
                 return;
         }
 
-        memset(file, 0, sizeof(file_t));
-        file->next = fhead.flist;
-        fhead.flist = file;
-        void (*close)(file_t *) = file->close;
-        
         mutex_release(fhead.mutex);
-        close(file);
+
+        /* the file isn't reachable anymore, it can be closed and freed */
+        void (*close)(file_t *) = file->close;
+        if (close)
+                close(file);
+
+        kmem_cache_free(fhead.cache, file);
 }
 
 int
@@ -155,7 +148,7 @@ file_open(char *path, int flags)
         file->inode = inode;
         file->offset = 0;
         
-        file->close = file_close;
+        file->close = inode_close;
         file->write = inode_write;
         file->read = inode_read;
         file->stat = inode_stat;
@@ -173,7 +166,6 @@ file_open(char *path, int flags)
 void
 file_init(void)
 {
+        fhead.cache = kmem_cache_create("file", sizeof(file_t));
         fhead.mutex = mutex_create();
-        fhead.flist = NULL;
-        fhead.ulist = NULL;
 }
@@ -239,6 +239,45 @@ ext2_get_iblock(inode_t *inode, uint32_t idx)
         return block;
 }
 
+/* like ext2_get_iblock, but holes aren't allocated and nothing is
+   written back, it returns 0 for a hole */
+static uint32_t
+ext2_lookup_iblock(inode_t *inode, uint32_t idx)
+{
+        if (idx < DIRECT_BLOCKS)
+                return inode->blocks[idx];
+
+        uint32_t ind_idx, times, r_idx;
+        if (idx < IND1_LIMIT) {
+                ind_idx = IND1_IDX;
+                times = 0;
+                r_idx = idx - DIRECT_BLOCKS;
+        } else if (idx < IND2_LIMIT) {
+                ind_idx = IND2_IDX;
+                times = 1;
+                r_idx = idx - IND1_LIMIT;
+        } else if (idx < IND3_LIMIT) {
+                ind_idx = IND3_IDX;
+                times = 2;
+                r_idx = idx - IND2_LIMIT;
+        } else {
+                return 0;
+        }
+
+        uint32_t block = inode->blocks[ind_idx];
+        for (int i = times; i >= 0 && block; --i) {
+                uint32_t div = ext2_get_div(i);
+
+                bio_buf_t *buf = ext2_read_block(inode->device, block);
+                block = ((uint32_t*)buf->buffer)[r_idx / div];
+                bio_release(buf);
+
+                r_idx %= div;
+        }
+
+        return block;
+}
+
 void
 ext2_inode_update(inode_t *inode)
 {
@@ -307,6 +346,65 @@ ext2_truncate(inode_t *inode) {
         ext2_inode_update(inode);
 }
 
+/* the window doubles while the file is read sequentially and it's
+   dropped at the first jump, the next window is queued when the reader
+   gets past the half of the current one. Reading the same block again
+   still counts as sequential, reads can be smaller than a block */
+static void
+ext2_read_ahead(inode_t *inode, uint32_t idx)
+{
+        int sequential = idx == inode->ra_next || idx + 1 == inode->ra_next;
+        inode->ra_next = idx + 1;
+
+        if (!sequential) {
+                inode->ra_window = 0;
+                inode->ra_end = idx + 1;
+                return;
+        }
+
+        if (inode->ra_window && idx + inode->ra_window / 2 < inode->ra_end)
+                return;
+
+        inode->ra_window = (inode->ra_window) ? inode->ra_window * 2 : RA_MIN_BLOCKS;
+        if (inode->ra_window > RA_MAX_BLOCKS)
+                inode->ra_window = RA_MAX_BLOCKS;
+
+        /* no block past the end of the file is read */
+        uint32_t blocks = RUP_DIVISION(inode->size, BLOCK_SIZE);
+        uint32_t start = (inode->ra_end > idx + 1) ? inode->ra_end : idx + 1;
+        uint32_t end = idx + 1 + inode->ra_window;
+        if (end > blocks)
+                end = blocks;
+
+        if (start >= end)
+                return;
+
+        inode->ra_end = end;
+
+        /* a request for every run of consecutive blocks on the disk,
+           it stops at the first hole, read ahead never allocates */
+        uint32_t first = ext2_lookup_iblock(inode, start), count = 1;
+        if (!first)
+                return;
+
+        for (uint32_t i = start + 1; i < end; ++i) {
+                uint32_t block = ext2_lookup_iblock(inode, i);
+                if (!block)
+                        break;
+
+                if (block == first + count) {
+                        ++count;
+                        continue;
+                }
+
+                bio_read_ahead(inode->device, first, count, BLOCK_SIZE);
+                first = block;
+                count = 1;
+        }
+
+        bio_read_ahead(inode->device, first, count, BLOCK_SIZE);
+}
+
 int
 ext2_read_content(inode_t *inode, void *dst, size_t offset, size_t size)
 {
@@ -320,6 +418,8 @@ ext2_read_content(inode_t *inode, void *dst, size_t offset, size_t size)
         
         size_t i = 0, len;
         for (; i < size; i += len, offset += len, dst8 += len) {
+                ext2_read_ahead(inode, offset / BLOCK_SIZE);
+
                 uint32_t block_idx = ext2_get_iblock(inode, offset / BLOCK_SIZE);
                 bio_buf_t *buf = ext2_read_block(inode->device, block_idx);
 
@@ -5,7 +5,7 @@
 #include <utils/hashtable.h>
 #include <kernel/inode.h>
 #include <kernel/mutex.h>
-#include <kernel/vmm.h>
+#include <kernel/slab.h>
 #include <kernel/dir.h>
 
 struct fs_itf {
@@ -15,10 +15,13 @@ struct fs_itf {
         uint32_t (*dinode_alloc)(int);
 };
 
+/* same scheme as the buffer cache, lookups share the lock and entries
+   that are used again stay on the free list until they reach its tail */
 struct {
         struct fs_itf fs_itfs[4];
+        kmem_cache_t *cache;
         hash_table_t *table;
-        semaphore_t *mutex;
+        rwsem_t rwsem;         /* table and free list */
         inode_t *lhead;
         inode_t *ltail;
 } ihead;
@@ -26,59 +29,84 @@ struct {
 static inode_t*
 inode_alloc(int device, uint32_t inode_n)
 {
-        inode_t *inode = kmalloc(sizeof(inode_t));
+        inode_t *inode = kmem_cache_alloc(ihead.cache);
         inode->ref_count = 1;
         inode->valid = 0;
         inode->device = device;
         inode->n = inode_n;
         inode->mutex = mutex_create();
+        inode->ra_next = 0;
+        inode->ra_end = 0;
+        inode->ra_window = 0;
+        inode->next = NULL;
+        inode->prev = NULL;
 
         /* the rest should be allocated by inode_lock */
         return inode;
 }
 
+static inline int
+inode_listed(inode_t *inode)
+{
+        return inode->prev || ihead.lhead == inode;
+}
+
 static void
 inode_remove(inode_t *inode)
 {
-        if (!inode->next && !inode->prev) {
+        if (!inode_listed(inode)) {
                 printf("[INODE] inode not part of list\n");
                 abort();
         }
         
-        if (!ihead.lhead && !ihead.ltail) {
-                printf("[INODE] removing from empty list\n");
-                abort();
-        }
-        
-        if (inode == ihead.lhead) {
+        if (inode->prev)
+                inode->prev->next = inode->next;
+        else
                 ihead.lhead = inode->next;
-                inode->next->prev = NULL;
-        }
 
-        if (inode == ihead.ltail) {
+        if (inode->next)
+                inode->next->prev = inode->prev;
+        else
                 ihead.ltail = inode->prev;
-                inode->prev->next = NULL;
-        }
 
-        if (inode != ihead.ltail && inode != ihead.lhead) {
-                inode->prev->next = inode->next;
-                inode->next->prev = inode->prev;
-        }
+        inode->next = NULL;
+        inode->prev = NULL;
+}
+
+static void
+inode_push(inode_t *inode)
+{
+        if (inode_listed(inode))
+                inode_remove(inode);
+
+        if (!ihead.lhead)
+                ihead.ltail = inode;
+        else
+                ihead.lhead->prev = inode;
+
+        inode->next = ihead.lhead;
+        ihead.lhead = inode;
 }
 
 static void
+inode_free(inode_t *inode)
+{
+        mutex_free(inode->mutex);
+        kmem_cache_free(ihead.cache, inode);
+}
+
+/* the evicted inode is freed by the caller once the lock is released */
+static inode_t*
 inode_evict(void)
 {
+        while (ihead.ltail && ihead.ltail->ref_count)
+                inode_remove(ihead.ltail);
+
         if (!ihead.ltail) {
                 printf("[INODE] there aren't any free inodes\n");
                 abort();
         }
 
-        if (ihead.ltail->ref_count) {
-                printf("[INODE] inode shouldn't be already free\n");
-                abort();
-        }
-
         inode_t *old = ihead.ltail;
         hash_key_t key = {((uint64_t)old->device << 32) | old->n};
         
@@ -88,46 +116,58 @@ inode_evict(void)
         }
 
         inode_remove(old);
-        kfree(old->mutex);
-        kfree(old);
+        return old;
+}
+
+static inode_t*
+inode_lookup(hash_key_t key)
+{
+        inode_t *inode = ht_get(ihead.table, key);
+        if (inode)
+                __atomic_add_fetch(&inode->ref_count, 1, __ATOMIC_ACQ_REL);
+
+        return inode;
 }
 
+/* same as bio_get, the new inode is allocated without the lock */
 inode_t*
 inode_get(int device, uint32_t inode_n)
 {
-        mutex_acquire(ihead.mutex);
-
         hash_key_t key = {((uint64_t)device << 32) | inode_n};
-        inode_t *inode = ht_get(ihead.table, key);
 
-        if (inode) {
-                if (!inode->ref_count++)
-                        inode_remove(inode);
+        rwsem_down_read(&ihead.rwsem);
+        inode_t *inode = inode_lookup(key);
+        rwsem_up_read(&ihead.rwsem);
 
-                mutex_release(ihead.mutex);
+        if (inode)
                 return inode;
-        }
 
-        inode = inode_alloc(device, inode_n);
-        
-        if (!ht_set(ihead.table, key, inode)) {
-                mutex_release(ihead.mutex);
+        inode_t *new = inode_alloc(device, inode_n);
+        rwsem_down_write(&ihead.rwsem);
+
+        inode = inode_lookup(key);
+        if (inode) {
+                rwsem_up_write(&ihead.rwsem);
+                inode_free(new);
                 return inode;
         }
 
-        int ret;
-        do {
-                inode_evict();
-                ret = ht_set(ihead.table, key, inode);
-        } while (ret && ihead.ltail);
+        inode_t *evicted = NULL;
+        while (ht_set(ihead.table, key, new)) {
+                inode_t *old = inode_evict();
+                old->next = evicted;
+                evicted = old;
+        }
+
+        rwsem_up_write(&ihead.rwsem);
 
-        if (!ret) {
-                mutex_release(ihead.mutex);
-                return inode;
+        while (evicted) {
+                inode_t *old = evicted;
+                evicted = old->next;
+                inode_free(old);
         }
 
-        printf("[INODE] can't get any free inode\n");
-        abort();
+        return new;
 }
 
 inode_t*
@@ -150,37 +190,50 @@ dinode_alloc(int device, uint16_t mode)
         return inode;
 }
 
+/* an inode without links is truncated by its last user before it goes
+   on the free list. The count only drops to zero with the lock held,
+   and the reference is taken back for the truncation, which sleeps, so
+   a racing release can't see the count at zero too */
 void
 inode_release(inode_t *inode)
 {
-        mutex_acquire(ihead.mutex);
-
-        if (!--inode->ref_count) {
-                if (!ihead.lhead)
-                        ihead.ltail = inode;
-                else
-                        ihead.lhead->prev = inode;
-
-                inode->next = ihead.lhead;
-                ihead.lhead = inode;
-
-                if (inode->valid && !inode->hard_links_count) {
-                        void (*inode_trunc)(inode_t *);
-                        inode_trunc = ihead.fs_itfs[inode->device].inode_trunc;
-                        inode_trunc(inode);
-                        inode->valid = 0;
-                }
+        /* only the last reference needs the lock */
+        int count = __atomic_load_n(&inode->ref_count, __ATOMIC_RELAXED);
+        while (count > 1)
+                if (__atomic_compare_exchange_n(&inode->ref_count, &count, count - 1, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                        return;
+
+        rwsem_down_write(&ihead.rwsem);
+
+        if (__atomic_sub_fetch(&inode->ref_count, 1, __ATOMIC_ACQ_REL)) {
+                rwsem_up_write(&ihead.rwsem);
+                return;
+        }
+
+        if (inode->valid && !inode->hard_links_count) {
+                __atomic_store_n(&inode->ref_count, 1, __ATOMIC_RELEASE);
+                rwsem_up_write(&ihead.rwsem);
+
+                void (*inode_trunc)(inode_t *);
+                inode_trunc = ihead.fs_itfs[inode->device].inode_trunc;
+                inode_trunc(inode);
+                inode->valid = 0;
+
+                /* it isn't valid anymore, it goes on the free list */
+                inode_release(inode);
+                return;
         }
 
-        mutex_release(ihead.mutex);
+        inode_push(inode);
+        rwsem_up_write(&ihead.rwsem);
 }
 
+/* the caller holds a reference, so the inode can't be evicted */
 inode_t*
 inode_dup(inode_t *inode)
 {
-        mutex_acquire(ihead.mutex);
-        ++inode->ref_count;
-        mutex_release(ihead.mutex);
+        __atomic_add_fetch(&inode->ref_count, 1, __ATOMIC_ACQ_REL);
         return inode;
 }
 
@@ -291,7 +344,8 @@ inode_add_itf(int device,
 void
 inode_init(void)
 {
-        ihead.mutex = mutex_create();
+        ihead.cache = kmem_cache_create("inode", sizeof(inode_t));
+        rwsem_init(&ihead.rwsem);
         ihead.lhead = NULL;
         ihead.ltail = NULL;
         ihead.table = ht_create(INODE_TABLE_SIZE, INODE_LOAD_FACTOR, 0); 
@@ -12,7 +12,7 @@ int
 pipe_buf_write(pipe_t *pipe, void *addr, size_t size)
 {
         if (pipe->b_read != pipe->b_write)
-                condvar_wait(&pipe->b_write, pipe->mutex);
+                wait_queue_wait(&pipe->writers, pipe->mutex);
         
         size_t remaining = size;
         if (size > pipe->size - (pipe->b_write % pipe->size))
@@ -29,13 +29,12 @@ pipe_unbuf_write(pipe_t *pipe, void *addr, size_t size)
         size_t i = 0;
         for (; i < size; ++i) {
                 while (pipe->b_write == pipe->b_read + PIPE_SIZE) {
-                        if (!pipe->read_open) {
-                                mutex_release(pipe->mutex);
+                        /* pipe_write releases the mutex */
+                        if (!pipe->read_open)
                                 return -1;
-                        }
-                        
-                        condvar_signal(&pipe->b_read);
-                        condvar_wait(&pipe->b_write, pipe->mutex);
+
+                        wait_queue_wake_one(&pipe->readers);
+                        wait_queue_wait(&pipe->writers, pipe->mutex);
                 }
 
                 pipe->buffer[pipe->b_write++ % PIPE_SIZE] = ((char*)addr)[i];
@@ -65,7 +64,7 @@ pipe_write(file_t *file, void *addr, size_t size)
         }
 
         if (pipe->type != PIPE_TYPE_BUF_BLOCK || !(pipe->b_write % pipe->size))
-                condvar_signal(&pipe->b_read);
+                wait_queue_wake_one(&pipe->readers);
         
         mutex_release(pipe->mutex);
         return ret;
@@ -78,7 +77,7 @@ pipe_bufblock_read(pipe_t *pipe, void *addr, size_t size)
                 return -1;
 
         if (pipe->b_read + size != pipe->b_write && pipe->write_open)
-                condvar_wait(&pipe->b_read, pipe->mutex);
+                wait_queue_wait(&pipe->readers, pipe->mutex);
 
         memcpy(addr, pipe->buffer, size);
         pipe->b_read += size;
@@ -89,7 +88,7 @@ static int
 pipe_bufchar_read(pipe_t *pipe, void *addr, char c)
 {
         if (pipe->b_read == pipe->b_write && pipe->write_open)
-                condvar_wait(&pipe->b_read, pipe->mutex);
+                wait_queue_wait(&pipe->readers, pipe->mutex);
         
         int i = 0;
         for (;;) {
@@ -109,7 +108,7 @@ static int
 pipe_unbuf_read(pipe_t *pipe, void *addr, size_t size)
 {
         if (pipe->b_read == pipe->b_write && pipe->write_open)
-                condvar_wait(&pipe->b_read, pipe->mutex);
+                wait_queue_wait(&pipe->readers, pipe->mutex);
 
         size_t i = 0;
         for (; i < size; ++i) {
@@ -152,7 +151,7 @@ pipe_read(file_t *file, void *addr, size_t size)
                 break;
         }
 
-        condvar_signal(&pipe->b_write);
+        wait_queue_wake_one(&pipe->writers);
         mutex_release(pipe->mutex);
         return ret;
 }
@@ -163,19 +162,19 @@ pipe_close(file_t *file)
         pipe_t *pipe = file->pipe;
         mutex_acquire(pipe->mutex);
 
+        /* every waiting task has to see the closed end */
         if (file->writep) {
                 pipe->write_open = 0;
-                condvar_signal(&pipe->b_read);
+                wait_queue_wake_all(&pipe->readers);
         } else {
                 pipe->read_open = 0;
+                wait_queue_wake_all(&pipe->writers);
         }
 
         mutex_release(pipe->mutex);
         if (!pipe->write_open && !pipe->read_open) {
-                kfree(pipe->mutex);
+                mutex_free(pipe->mutex);
                 kfree(pipe->buffer);
-                condvar_free(&pipe->b_read);
-                condvar_free(&pipe->b_write);
                 kfree(pipe);
         }
 }
@@ -202,6 +201,8 @@ pipe_alloc(file_t **f_read, file_t **f_write, uint32_t size, pipe_type_t type)
         pipe->b_read = 0;
         pipe->buffer = kmalloc(size);
         pipe->mutex = mutex_create();
+        wait_queue_init(&pipe->readers);
+        wait_queue_init(&pipe->writers);
 
         (*f_read)->readp = 1;
         (*f_read)->writep = 0;
@@ -10,15 +10,20 @@
 #include <kernel/hpet.h>
 #include <kernel/idt.h>
 #include <kernel/task.h>
+#include <kernel/smp.h>
+#include <kernel/spinlock.h>
 
 /* LAPIC timer is set up to interrupt every 10ms */
 extern void delay_handler(interrupt_frame_t *frame);
 
+/* apic id of the BSP, every interrupt is routed to it */
 static int processor_id;
 static uintptr_t ioapic_addr = 0;
 static uintptr_t lapic_addr = 0;
 static uint32_t max_irqs;
 static int32_t *ioapic_mapping;
+/* initial count of the periodic timer, measured at boot */
+static uint32_t lapic_timer_count;
 
 static inline void
 lapic_write_reg(uintptr_t reg, uint32_t data)
@@ -51,7 +56,8 @@ madt_parse(void)
 {
         madt_header_t *madt_header = (madt_header_t*) rsdt_get_entry("APIC");
         lapic_addr = madt_header->lapic_addr;
-        page_identity_map(page_directory, lapic_addr, LAPIC_SIZE); 
+        page_identity_map_mmio(page_directory, lapic_addr, LAPIC_SIZE); 
+        processor_id = lapic_get_id();
 
         /* traversing the entries */
         uintptr_t madt_entry = (uintptr_t)madt_header + sizeof(madt_header_t);
@@ -68,13 +74,16 @@ madt_parse(void)
                         [madt_record->type]);
                 
                 switch (madt_record->type) {
-                /* get processor id */
+                /* every enabled processor is started by smp_init */
                 case MADT_TYPE_LAPIC: {
                         lapic_record_t *lapic_record = (lapic_record_t*) madt_record;
 
-                        kprintf("processor id: %x\n", lapic_record->processor_id);
+                        kprintf("processor id: %x, apic id: %x\n",
+                                lapic_record->processor_id, lapic_record->apic_id);
                         
-                        processor_id = lapic_record->processor_id;
+                        if (lapic_record->flags & MADT_LAPIC_ENABLED)
+                                smp_add_cpu(lapic_record->apic_id,
+                                            lapic_record->apic_id == processor_id);
                         break;
                 }
 
@@ -85,7 +94,7 @@ madt_parse(void)
                         kprintf("ioapic address: %x\n", ioapic_record->ioapic_addr);
                         
                         ioapic_addr = ioapic_record->ioapic_addr;
-                        page_identity_map(page_directory, ioapic_addr, IOAPIC_SIZE);
+                        page_identity_map_mmio(page_directory, ioapic_addr, IOAPIC_SIZE);
 
                         max_irqs = (ioapic_read_reg(IOAPIC_VER_REG) >> 16) + 1;
                         ioapic_mapping = (int32_t*) kmalloc(sizeof(int32_t) * max_irqs);
@@ -124,6 +133,27 @@ lapic_sendEOI(void)
         lapic_write_reg(LAPIC_EOI_REG, 0);
 }
 
+uint32_t
+lapic_get_id(void)
+{
+        return lapic_read_reg(LAPIC_ID_REG) >> 24;
+}
+
+/* the high half selects the destination, writing the low half sends it */
+void
+lapic_send_ipi(uint32_t apic_id, uint32_t command)
+{
+        /* an interrupt handler sending an ipi in between would
+           change the destination */
+        uint32_t flags = irq_save();
+
+        lapic_write_reg(LAPIC_ICR_HIGH_REG, apic_id << 24);
+        lapic_write_reg(LAPIC_ICR_LOW_REG, command);
+
+        while (lapic_read_reg(LAPIC_ICR_LOW_REG) & LAPIC_ICR_PENDING);
+        irq_restore(flags);
+}
+
 static void
 lapic_mask_int(void)
 {
@@ -133,9 +163,8 @@ lapic_mask_int(void)
 }
 
 static void
-lapic_init(void)
+lapic_enable(void)
 {
-        kprintf("IOAPIC: %x\n", ioapic_addr);
         lapic_mask_int();
 
         asm volatile ("movl $0x1b, %ecx\n\t"
@@ -152,6 +181,13 @@ lapic_init(void)
         lapic_write_reg(LAPIC_TASK_PRIO_REG, 0);
 }
 
+static void
+lapic_init(void)
+{
+        kprintf("IOAPIC: %x\n", ioapic_addr);
+        lapic_enable();
+}
+
 static void
 ioapic_init(void)
 {
@@ -242,11 +278,36 @@ lapic_timer_init2(interrupt_frame_t *frame)
         ioapic_irq_clear_mask(0);
         done = 1;
         
+        lapic_timer_count = ticks_1ms;
         lapic_write_reg(LAPIC_INIT_COUNTER_REG, ticks_1ms);
         lapic_write_reg(LAPIC_TIMER_REG, (IRQ_OFFSET + LEGACY_PIC_OFFSET + 0) | LAPIC_TIMER_PERIODIC);
         lapic_write_reg(LAPIC_TIMER_DIV_REG, LAPIC_TIMER_DIVISION_X16);
 }
 
+void
+lapic_timer_stop(void)
+{
+        lapic_write_reg(LAPIC_TIMER_REG, LAPIC_TIMER_MASK);
+}
+
+/* application processors use the same count measured by the BSP,
+   all the local apic timers run at the bus frequency */
+void
+lapic_ap_init(void)
+{
+        lapic_enable();
+        lapic_write_reg(LAPIC_TIMER_DIV_REG, LAPIC_TIMER_DIVISION_X16);
+        lapic_timer_start();
+}
+
+/* writing the initial count restarts the count down */
+void
+lapic_timer_start(void)
+{
+        lapic_write_reg(LAPIC_TIMER_REG, (IRQ_OFFSET + LEGACY_PIC_OFFSET + 0) | LAPIC_TIMER_PERIODIC);
+        lapic_write_reg(LAPIC_INIT_COUNTER_REG, lapic_timer_count);
+}
+
 void
 apic_init(void)
 {
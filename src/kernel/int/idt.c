@@ -3,11 +3,15 @@
 #include <stdio.h>
 
 #include <kernel/idt.h>
-#include <kernel/vmm.h>
 #include <kernel/debug.h>
 
-idt_entry_t *idt_entries;
-idt_ptr_t *idt_ptr;
+/* the table is static because it has to be loaded before the kernel
+   heap can grow, the heap is mapped by the page fault handler */
+static idt_entry_t idt_table[IDT_ENTRIES];
+static idt_ptr_t idt_descriptor;
+
+idt_entry_t *idt_entries = idt_table;
+idt_ptr_t *idt_ptr = &idt_descriptor;
 
 void
 idt_create(idt_entry_t *descriptor, uintptr_t offset, idt_flag_t flags)
@@ -29,10 +33,8 @@ idt_init(void)
         kprintf("[IDT] setup STARTING\n");
 
         size_t idt_size = sizeof(idt_entry_t) * IDT_ENTRIES; 
-        idt_entries = kmalloc(idt_size);
         memset(idt_entries, 0, idt_size);
 
-        idt_ptr = kmalloc(sizeof(idt_ptr_t));
         idt_ptr->limit = idt_size - 1;
         idt_ptr->base = (uintptr_t) idt_entries;
 
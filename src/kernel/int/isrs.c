@@ -6,6 +6,7 @@
 #include <kernel/idt.h>
 #include <kernel/isrs.h>
 #include <kernel/apic.h>
+#include <kernel/fpu.h>
 
 #define INT_HANDLER(NAME, TYPE, MESSAGE) \
         __attribute__ ((interrupt)) \
@@ -99,7 +100,6 @@ INT_HANDLER(BP, trap, 3)
 INT_HANDLER(OF, trap, 4)
 INT_HANDLER(BR, fault, 5)
 INT_HANDLER(UD, fault, 6)
-INT_HANDLER(NM, fault, 7)
 INT_CODE_HANDLER(DF, abort, 8)
 INT_HANDLER(CSO, fault, 9)
 INT_CODE_HANDLER(TS, fault, 10)
@@ -117,12 +117,26 @@ INT_HANDLER(HV, fault, 22)
 INT_CODE_HANDLER(VC, fault, 23)
 INT_CODE_HANDLER(SX, fault, 24)
 
+/* lazy fpu restore, exceptions don't need an EOI */
+__attribute__ ((interrupt))
+static void
+isrNM(interrupt_frame_t *frame)
+{
+        (void) frame;
+        fpu_trap_handler();
+}
+
 __attribute__ ((interrupt))
 static void
 isrPF(interrupt_frame_t *frame, int32_t error_code)
 {
         uintptr_t addr;
         asm volatile ("mov %%cr2, %0\n\t" : "=r"(addr));
+
+        /* exceptions don't need an EOI */
+        if (!page_fault_handler(addr, error_code))
+                return;
+
         kprintf("ADDR: %x\n", addr);
         code_fault_handler(error_messages[14], frame, error_code);
         lapic_sendEOI();
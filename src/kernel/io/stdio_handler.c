@@ -32,7 +32,7 @@ stdout_handler(void)
                         putchar(stdout_buffer[i]);
                 
                 mutex_acquire(stdout_read->pipe->mutex);
-                condvar_wait(&stdout_read->pipe->b_read, stdout_read->pipe->mutex);
+                wait_queue_wait(&stdout_read->pipe->readers, stdout_read->pipe->mutex);
                 mutex_release(stdout_read->pipe->mutex);
         }
 }
@@ -12,6 +12,7 @@
 #include <kernel/rsdt.h>
 #include <kernel/gdt.h>
 #include <kernel/tss.h>
+#include <kernel/smp.h>
 #include <kernel/idt.h>
 #include <kernel/isrs.h>
 #include <kernel/apic.h>
@@ -25,6 +26,7 @@
 #include <kernel/pit.h>
 #include <kernel/task.h>
 #include <kernel/mutex.h>
+#include <kernel/fpu.h>
 #include <kernel/tty.h>
 #include <kernel/serialport.h>
 #include <kernel/shell.h>
@@ -49,17 +51,25 @@ kernel_main(void)
         page_init();
         pmm_init();
         vmm_init();
-        multitask_init();
 
-        terminal_initialize();
-        serial_initialize();
-        //vbe_init();
-        
+        /* the kernel heap is mapped on demand, so the page fault
+           handler has to be installed before it grows */
         gdt_init();
         tss_init();
 
         idt_init();
         isrs_init();
+
+        pmm_buddy_init();
+        pmm_refs_init();
+        multitask_init();
+        mutex_init();
+        fpu_init();
+
+        terminal_initialize();
+        serial_initialize();
+        //vbe_init();
+        
         syscall_init();
         
         rsdt_init();
@@ -68,6 +78,9 @@ kernel_main(void)
         pic_init();
         STI();
         apic_init();
+        task_tickless_init();
+        page_shootdown_init();
+        smp_init();
 
         pci_init();
         ide_init();
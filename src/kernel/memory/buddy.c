@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kernel/buddy.h>
+#include <kernel/memory.h>
+#include <kernel/vmm.h>
+#include <kernel/debug.h>
+
+/* the zone is physical memory that isn't mapped anywhere, so the free lists
+   can't live inside the free blocks, every page has instead an entry in
+   the orders and links arrays which are allocated in the kernel heap */
+static buddy_zone_t zone;
+
+static void
+buddy_push(uint32_t index, uint32_t order)
+{
+        uint32_t head = zone.free_heads[order];
+
+        zone.links[index].next = head;
+        zone.links[index].prev = BUDDY_NONE;
+        if (head != BUDDY_NONE)
+                zone.links[head].prev = index;
+
+        zone.free_heads[order] = index;
+        zone.orders[index] = order | BUDDY_FREE;
+}
+
+static void
+buddy_remove(uint32_t index, uint32_t order)
+{
+        uint32_t next = zone.links[index].next;
+        uint32_t prev = zone.links[index].prev;
+
+        if (prev != BUDDY_NONE)
+                zone.links[prev].next = next;
+        else
+                zone.free_heads[order] = next;
+
+        if (next != BUDDY_NONE)
+                zone.links[next].prev = prev;
+
+        zone.orders[index] = BUDDY_INVALID;
+}
+
+static inline uint32_t
+buddy_index(void *page)
+{
+        return ((uintptr_t)page - zone.start) / PAGE_FRAME_SIZE;
+}
+
+/* smallest order that can contain the requested amount of pages */
+uint32_t
+buddy_order(uint32_t pages)
+{
+        uint32_t order = 0;
+        for (; (1U << order) < pages; ++order);
+
+        return order;
+}
+
+int
+buddy_owns(void *page)
+{
+        uintptr_t addr = (uintptr_t)page;
+        return zone.pages && addr >= zone.start &&
+                addr < zone.start + zone.pages * PAGE_FRAME_SIZE;
+}
+
+void*
+buddy_alloc(uint32_t order)
+{
+        if (order > BUDDY_MAX_ORDER)
+                return NULL;
+
+        /* first order that has a free block big enough */
+        uint32_t current = order;
+        for (; current <= BUDDY_MAX_ORDER; ++current)
+                if (zone.free_heads[current] != BUDDY_NONE)
+                        break;
+
+        if (current > BUDDY_MAX_ORDER) {
+                DPRINTF("[BUDDY] no free block of order %d\n", order);
+                return NULL;
+        }
+
+        uint32_t index = zone.free_heads[current];
+        buddy_remove(index, current);
+
+        /* the upper halves that aren't needed go back to the free lists */
+        while (current > order) {
+                --current;
+                buddy_push(index + (1 << current), current);
+        }
+
+        zone.orders[index] = order;
+        zone.free_pages -= 1 << order;
+
+        DPRINTF("[BUDDY] allocated block of order %d at address %x\n",
+                order, zone.start + index * PAGE_FRAME_SIZE);
+        return (void*)(zone.start + index * PAGE_FRAME_SIZE);
+}
+
+void
+buddy_free(void *page)
+{
+        uint32_t index = buddy_index(page);
+        uint32_t order = zone.orders[index];
+
+        if (order & BUDDY_FREE || order > BUDDY_MAX_ORDER) {
+                printf("[BUDDY] freeing block that isn't allocated: %x\n", page);
+                abort();
+        }
+
+        zone.orders[index] = BUDDY_INVALID;
+        zone.free_pages += 1 << order;
+
+        /* merging with the buddy as long as the buddy is free and whole */
+        for (; order < BUDDY_MAX_ORDER; ++order) {
+                uint32_t buddy = index ^ (1 << order);
+
+                if (buddy >= zone.pages || zone.orders[buddy] != (order | BUDDY_FREE))
+                        break;
+
+                buddy_remove(buddy, order);
+                index &= ~(1 << order);
+        }
+
+        buddy_push(index, order);
+
+        DPRINTF("[BUDDY] freed block at address %x, merged to order %d\n",
+                page, order);
+}
+
+uint32_t
+buddy_free_pages(void)
+{
+        return zone.free_pages;
+}
+
+void
+buddy_print_info(void)
+{
+        kprintf("[BUDDY] free pages: %d / %d\n", zone.free_pages, zone.pages);
+        for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; ++order) {
+                uint32_t count = 0;
+                uint32_t index = zone.free_heads[order];
+                for (; index != BUDDY_NONE; index = zone.links[index].next)
+                        ++count;
+
+                kprintf("[BUDDY] order %d: %d free blocks\n", order, count);
+        }
+}
+
+/* start has to be aligned to the biggest block, otherwise
+   buddies wouldn't be physically aligned */
+void
+buddy_init(uintptr_t start, uint32_t pages)
+{
+        kprintf("[BUDDY] setup STARTING\n");
+
+        for (uint32_t order = 0; order <= BUDDY_MAX_ORDER; ++order)
+                zone.free_heads[order] = BUDDY_NONE;
+
+        if (!pages) {
+                kprintf("[BUDDY] no memory reserved, buddy allocator disabled\n");
+                return;
+        }
+
+        zone.orders = kmalloc(sizeof(uint8_t) * pages);
+        zone.links = kmalloc(sizeof(buddy_link_t) * pages);
+        memset(zone.orders, BUDDY_INVALID, sizeof(uint8_t) * pages);
+
+        zone.start = start;
+        zone.pages = pages;
+        zone.free_pages = pages;
+
+        /* the zone is split in the biggest blocks possible */
+        for (uint32_t index = 0; index < pages; ) {
+                uint32_t order = BUDDY_MAX_ORDER;
+                for (; (index & ((1 << order) - 1)) || index + (1 << order) > pages; --order);
+
+                buddy_push(index, order);
+                index += 1 << order;
+        }
+
+        kprintf("[BUDDY] zone at address 0x%x, pages: 0x%x (%d)\n",
+                start, pages, pages);
+        kprintf("[BUDDY] setup COMPLETE\n");
+}
@@ -5,9 +5,54 @@
 #include <kernel/page.h>
 #include <kernel/pmm.h>
 #include <kernel/memory.h>
+#include <kernel/task.h>
+#include <kernel/vmm.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/apic.h>
+#include <kernel/idt.h>
 
+/* after page_init it's the recursive address of the current page directory */
 pd_entry_t *page_directory;
-static page_entry_t page_table1[NUM_OF_ENTRIES] __attribute__ ((aligned(PAGE_FRAME_SIZE))); 
+/* page directory of the kernel, kernel half of every other page directory
+   is copied from this one */
+static pd_entry_t *kernel_directory;
+uintptr_t kernel_page_dir;
+/* incremented every time a PDE is added to the kernel half */
+uint32_t kernel_pde_version = 1;
+
+/* frames of other address spaces are temporary mapped here, the table is
+   static because it's needed before the PMM is ready and it's shared by
+   every page directory */
+static page_entry_t scratch_table[NUM_OF_ENTRIES] __attribute__ ((aligned(PAGE_FRAME_SIZE)));
+
+/* kernel directory, kernel tables and the shared scratch slots, it's taken
+   with interrupts disabled because the fault handler maps pages too */
+static spinlock_t page_lock = SPINLOCK_INIT;
+
+/* kernel half invalidations are sent to the other cpus, the cpu that
+   sends them waits until every cpu has done them. pending has a bit
+   for every cpu that hasn't done them yet */
+static spinlock_t shootdown_lock = SPINLOCK_INIT;
+static page_flush_t *shootdown_flush;
+static volatile uint32_t shootdown_pending;
+
+/* kernel half PDEs are only added to the kernel directory and to the
+   current one, other address spaces copy them when they need them */
+int
+page_sync_kernel_pde(uintptr_t addr)
+{
+        uint32_t pd_index = page_get_pd_index(addr);
+
+        if (pd_index < PAGE_KERNEL_INDEX || pd_index == NUM_OF_ENTRIES - 1)
+                return 0;
+
+        if (~kernel_directory[pd_index] & PD_PRESENT)
+                return 0;
+
+        page_directory[pd_index] = kernel_directory[pd_index];
+        return 1;
+}
 
 /* these two functions are pratically the same, but they are divided
    because of the debug info */
@@ -44,6 +89,17 @@ page_get_pt(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag)
         uint32_t pd_index = page_get_pd_index(addr);
         pd_entry_t *pd_entry = page_dir + pd_index;
         page_entry_t *page_table = (page_entry_t*) RECURSIVE_INDEX(pd_index);
+
+        /* kernel tables created in another address space */
+        if (~*pd_entry & PD_PRESENT)
+                page_sync_kernel_pde(addr);
+
+        /* a 4 MiB page doesn't have a page table */
+        if (page_is_large(*pd_entry)) {
+                DPRINTF("[ERROR][PAGING] address 0x%x is in a 4 MiB page, "
+                        "there isn't a page table\n", addr);
+                return NULL;
+        }
         
         if (~*pd_entry & PD_PRESENT) {
                 if (!alloc_flag) {
@@ -58,6 +114,12 @@ page_get_pt(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag)
                 /* memset is IMPORTANT, otherwise there is random data and
                    comparison to check if page table is present can fail */
                 memset(page_table, 0, PAGE_FRAME_SIZE);
+
+                /* every address space shares the kernel tables */
+                if (pd_index >= PAGE_KERNEL_INDEX) {
+                        kernel_directory[pd_index] = *pd_entry;
+                        ++kernel_pde_version;
+                }
         }
 
         return page_table;
@@ -68,13 +130,21 @@ page_entry_t*
 page_get_pt_entry(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag)
 {
         uint32_t pt_index = page_get_pt_index(addr);
-        page_entry_t *page_entry = page_get_pt(page_dir, addr, PAGE_ALLOC) + pt_index;
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        page_entry_t *page_table = page_get_pt(page_dir, addr, PAGE_ALLOC);
+        if (!page_table) {
+                spin_unlock_irqrestore(&page_lock, flags);
+                return NULL;
+        }
+
+        page_entry_t *page_entry = page_table + pt_index;
 
         if (~*page_entry & PT_PRESENT) {
                 if (!alloc_flag) {
                         DPRINTF("[ERROR][PAGING] not allocated page 0x%x at index "
                                 "0x%x (%d), can't be accessed\n",
                                 addr, pt_index, pt_index);
+                        spin_unlock_irqrestore(&page_lock, flags);
                         return NULL;
                 }
 
@@ -84,13 +154,233 @@ page_get_pt_entry(pd_entry_t *page_dir, uintptr_t addr, alloc_flag_t alloc_flag)
                 pt_add_entry(page_entry, pmm_alloc(), PT_PRESENT | PT_READ_WRITE | PT_USER);
         }
 
+        spin_unlock_irqrestore(&page_lock, flags);
         return page_entry;
 }
 
+/* reloading CR3 flushes every TLB entry */
+void
+page_flush_all(void)
+{
+        asm volatile ("movl %%cr3, %%eax\n\t"
+                      "movl %%eax, %%cr3\n\t"
+                      : : : "eax", "memory");
+}
+
+/* invalidations are collected and done all together, past
+   PAGE_FLUSH_MAX addresses it's cheaper to flush the whole TLB */
+void
+page_flush_add(page_flush_t *flush, uintptr_t addr)
+{
+        if (flush->count < PAGE_FLUSH_MAX)
+                flush->addrs[flush->count] = addr;
+
+        if (addr >= KERNEL_OFFSET)
+                flush->kernel = 1;
+
+        ++flush->count;
+}
+
+static void
+page_flush_local(page_flush_t *flush)
+{
+        if (flush->count > PAGE_FLUSH_MAX) {
+                DPRINTF("[PAGING] %d invalidations, flushing whole TLB\n", flush->count);
+                page_flush_all();
+        } else {
+                for (uint32_t i = 0; i < flush->count; ++i)
+                        page_invalidate(flush->addrs[i]);
+        }
+}
+
+/* it's also called while a cpu waits to send its own invalidations,
+   so two cpus sending them at the same time can't wait for each other */
+static void
+page_shootdown_ack(void)
+{
+        uint32_t bit = 1 << cpu_current()->id;
+        if (~__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) & bit)
+                return;
+
+        page_flush_local(shootdown_flush);
+        __atomic_fetch_and(&shootdown_pending, ~bit, __ATOMIC_RELEASE);
+}
+
+__attribute__ ((interrupt))
+static void
+page_shootdown_handler(interrupt_frame_t *frame)
+{
+        (void) frame;
+        page_shootdown_ack();
+        lapic_sendEOI();
+}
+
+/* WARNING! the caller can't hold a lock that is taken with interrupts
+   disabled, a cpu spinning on it would never get the ipi */
+static void
+page_shootdown(page_flush_t *flush)
+{
+        uint32_t flags = irq_save();
+        uint32_t self = cpu_current()->id;
+
+        while (!spin_trylock(&shootdown_lock))
+                page_shootdown_ack();
+
+        uint32_t targets = 0;
+        for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+                if (cpu != self && cpus[cpu].started)
+                        targets |= 1 << cpu;
+
+        if (targets) {
+                shootdown_flush = flush;
+                __atomic_store_n(&shootdown_pending, targets, __ATOMIC_RELEASE);
+
+                for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+                        if (targets & 1 << cpu)
+                                lapic_send_ipi(cpus[cpu].apic_id,
+                                               LAPIC_ICR_FIXED | PAGE_SHOOTDOWN_VECTOR);
+
+                while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE))
+                        asm volatile ("pause");
+        }
+
+        spin_unlock(&shootdown_lock);
+        irq_restore(flags);
+}
+
+/* frames are given back only after every TLB has been flushed,
+   otherwise another cpu could still write to a reused frame */
+void
+page_flush_finish(page_flush_t *flush)
+{
+        page_flush_local(flush);
+        if (flush->kernel && cpu_count > 1)
+                page_shootdown(flush);
+
+        for (uint32_t i = 0; i < flush->frame_count; ++i)
+                pmm_free(flush->frames[i]);
+
+        flush->count = 0;
+        flush->kernel = 0;
+        flush->frame_count = 0;
+}
+
+/* the TLB can't contain a not present entry, so invalidation
+   is needed only when a present entry is replaced */
+static int
+page_map_locked(pd_entry_t *page_dir, uintptr_t addr, void *frame, pt_flags_t flags,
+                page_flush_t *flush)
+{
+        page_entry_t *page_table = page_get_pt(page_dir, addr, PAGE_ALLOC);
+        if (!page_table)
+                return -1;
+
+        page_entry_t *pt_entry = page_table + page_get_pt_index(addr);
+        page_entry_t old_entry = *pt_entry;
+
+        pt_add_entry(pt_entry, frame, flags | PT_PRESENT);
+        if (old_entry & PT_PRESENT)
+                page_flush_add(flush, addr);
+
+        return 0;
+}
+
+int
+page_map(pd_entry_t *page_dir, uintptr_t addr, void *frame, pt_flags_t flags)
+{
+        page_flush_t flush = {0};
+        uint32_t lock_flags = spin_lock_irqsave(&page_lock);
+        int ret = page_map_locked(page_dir, addr, frame, flags, &flush);
+        spin_unlock_irqrestore(&page_lock, lock_flags);
+        page_flush_finish(&flush);
+
+        return ret;
+}
+
+/* returns the frame that was mapped, the TLB entry is added to flush */
+static void*
+page_unmap_entry(pd_entry_t *page_dir, uintptr_t addr, page_flush_t *flush)
+{
+        page_entry_t *page_table = page_get_pt(page_dir, addr, NO_ALLOC);
+        if (!page_table)
+                return NULL;
+
+        page_entry_t *pt_entry = page_table + page_get_pt_index(addr);
+        if (~*pt_entry & PT_PRESENT)
+                return NULL;
+
+        void *frame = (void*)(*pt_entry & ~(PAGE_FRAME_SIZE - 1));
+        *pt_entry = 0;
+        page_flush_add(flush, addr);
+
+        return frame;
+}
+
+void*
+page_unmap(pd_entry_t *page_dir, uintptr_t addr)
+{
+        page_flush_t flush = {0};
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        void *frame = page_unmap_entry(page_dir, addr, &flush);
+        spin_unlock_irqrestore(&page_lock, flags);
+        page_flush_finish(&flush);
+
+        return frame;
+}
+
+/* new frames are allocated for every page of the range */
+int
+page_map_range(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size, pt_flags_t flags)
+{
+        uintptr_t end = ALIGN_ADDR(addr + size, PAGE_FRAME_SIZE);
+        uintptr_t start = addr & ~(PAGE_FRAME_SIZE - 1);
+
+        for (addr = start; addr < end; addr += PAGE_FRAME_SIZE) {
+                void *frame = pmm_alloc();
+                if (frame && !page_map(page_dir, addr, frame, flags))
+                        continue;
+
+                /* nothing of the range is left mapped on failure */
+                if (frame)
+                        pmm_free(frame);
+                page_unmap_range(page_dir, start, addr - start, 1);
+                return -1;
+        }
+
+        return 0;
+}
+
+/* frames are freed only if free_frames is set */
+void
+page_unmap_range(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size, int free_frames)
+{
+        page_flush_t flush = {0};
+        uintptr_t end = ALIGN_ADDR(addr + size, PAGE_FRAME_SIZE);
+        addr &= ~(PAGE_FRAME_SIZE - 1);
+
+        /* the flush waits for the other cpus, so it's done without the
+           lock, every PAGE_FLUSH_MAX frames that have to be freed */
+        while (addr < end) {
+                uint32_t flags = spin_lock_irqsave(&page_lock);
+                for (; addr < end && flush.frame_count < PAGE_FLUSH_MAX; addr += PAGE_FRAME_SIZE) {
+                        void *frame = page_unmap_entry(page_dir, addr, &flush);
+                        if (frame && free_frames)
+                                flush.frames[flush.frame_count++] = frame;
+                }
+                spin_unlock_irqrestore(&page_lock, flags);
+
+                page_flush_finish(&flush);
+        }
+}
+
 /* WARNING! different from precedent functions, it never allocates */
 uintptr_t
 page_get_phys_addr(pd_entry_t *page_dir, uintptr_t addr)
 {
+        pd_entry_t pd_entry = page_dir[page_get_pd_index(addr)];
+        if (page_is_large(pd_entry))
+                return (pd_entry & ~PAGE_LARGE_MASK) | (addr & PAGE_LARGE_MASK);
+
         page_entry_t *pt_entry = page_get_pt_entry(page_dir, addr, NO_ALLOC);
         
         return ((uintptr_t)*pt_entry & 0xFFFFF000) | (addr & 0xFFF);
@@ -99,38 +389,364 @@ page_get_phys_addr(pd_entry_t *page_dir, uintptr_t addr)
 /* WARNING! can only access the addresses contained in a single table
             and the table should be already be present */
 static void
-page_identity_pte(page_entry_t *page_table, uintptr_t addr, uintptr_t size)
+page_identity_pte(page_entry_t *page_table, uintptr_t addr, uintptr_t size, pt_flags_t flags)
 {
         page_entry_t *entry = page_table + page_get_pt_index(addr);
-        page_entry_t *last_entry = page_table + page_get_pt_index(addr + size);
+        page_entry_t *last_entry = page_table + page_get_pt_index(addr + size - 1);
 
         DPRINTF("[PAGING] identity mapping page table 0x%x from index %d "
                 "(addr 0x%x) to index %d (addr 0x%x)\n",
                 page_table, entry - page_table, addr, last_entry - page_table,
                 addr + size);
         
+        addr &= ~(PAGE_FRAME_SIZE - 1);
         for (; entry <= last_entry; ++entry, addr += PAGE_FRAME_SIZE)
-                pt_add_entry(entry, (void*)addr, PT_PRESENT | PT_READ_WRITE | PT_USER);
+                pt_add_entry(entry, (void*)addr, flags);
 }
-        
-void
-page_identity_map(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size)
+
+/* a single PDE maps 4 MiB of memory, addr has to be 4 MiB aligned */
+static void
+page_identity_map_large(pd_entry_t *page_dir, uintptr_t addr, pd_flags_t flags)
+{
+        uint32_t pd_index = page_get_pd_index(addr);
+
+        DPRINTF("[PAGING] identity mapping 4 MiB page at addr 0x%x\n", addr);
+        pd_add_table(page_dir + pd_index, (page_entry_t*)addr,
+                     flags | PD_PRESENT | PD_PAGESIZE);
+
+        if (pd_index >= PAGE_KERNEL_INDEX && kernel_directory) {
+                kernel_directory[pd_index] = page_dir[pd_index];
+                ++kernel_pde_version;
+        }
+}
+
+/* whole 4 MiB aligned chunks that aren't mapped yet get a single 4 MiB page,
+   the rest is mapped with 4 KiB pages and chunks already in a 4 MiB page
+   are skipped */
+static void
+page_identity_map_flags(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size,
+                        pd_flags_t pd_flags, pt_flags_t pt_flags)
 {
         uintptr_t end_addr = addr + size;
         DPRINTF("[PAGING] identity mapping from addr 0x%x to 0x%x\n", addr, end_addr);
 
-        uintptr_t page_size;
-        for (; addr < end_addr; addr += page_size, size -= page_size) {
-                page_entry_t *page_table = page_get_pt(page_dir, addr, PAGE_ALLOC);
+        uintptr_t chunk_size;
+        for (; addr < end_addr; addr += chunk_size) {
+                pd_entry_t *pd_entry = page_dir + page_get_pd_index(addr);
 
                 /* max size that can be identity mapped in this table */
-                uintptr_t max_size = PAGE_MEMORY - (addr & 0xFFF);
+                uintptr_t max_size = PAGE_MEMORY - (addr & PAGE_LARGE_MASK);
                 /* size that should be identity mapped */
-                page_size = (size > max_size) ? max_size : size; 
+                chunk_size = (end_addr - addr > max_size) ? max_size : end_addr - addr;
+
+                if (page_is_large(*pd_entry))
+                        continue;
+
+                if (chunk_size == PAGE_MEMORY && ~*pd_entry & PD_PRESENT) {
+                        page_identity_map_large(page_dir, addr, pd_flags);
+                        continue;
+                }
 
-                page_identity_pte(page_table, addr, page_size);
+                page_entry_t *page_table = page_get_pt(page_dir, addr, PAGE_ALLOC);
+                page_identity_pte(page_table, addr, chunk_size, pt_flags);
         }
 }
+        
+void
+page_identity_map(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size)
+{
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        page_identity_map_flags(page_dir, addr, size,
+                                PD_READ_WRITE | PD_USER,
+                                PT_PRESENT | PT_READ_WRITE | PT_USER);
+        spin_unlock_irqrestore(&page_lock, flags);
+}
+
+/* MMIO windows are small and close to each other (LAPIC, IOAPIC and HPET
+   are all in the 4 MiB below 0xFF000000), so the whole 4 MiB region that
+   contains the window is mapped with a single cache disabled PDE */
+void
+page_identity_map_mmio(pd_entry_t *page_dir, uintptr_t addr, uintptr_t size)
+{
+        uintptr_t start = addr & ~PAGE_LARGE_MASK;
+        uintptr_t end = ALIGN_ADDR(addr + size, PAGE_MEMORY);
+        
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        page_identity_map_flags(page_dir, start, end - start,
+                                PD_READ_WRITE | PD_USER | PD_PCD | PD_PWT,
+                                PT_PRESENT | PT_READ_WRITE | PT_USER | PT_PCD | PT_PWT);
+        spin_unlock_irqrestore(&page_lock, flags);
+}
+
+/* slots are used with page_lock held, so they can't be
+   used by two tasks at the same time */
+static void*
+page_scratch_map(uint32_t slot, uintptr_t frame)
+{
+        uintptr_t addr = PAGE_SCRATCH_START + slot * PAGE_FRAME_SIZE;
+
+        pt_add_entry(scratch_table + slot, (void*)frame, PT_PRESENT | PT_READ_WRITE);
+        page_invalidate(addr);
+        return (void*)addr;
+}
+
+static void
+page_scratch_unmap(uint32_t slot)
+{
+        scratch_table[slot] = 0;
+        page_invalidate(PAGE_SCRATCH_START + slot * PAGE_FRAME_SIZE);
+}
+
+/* new page directory that only has the kernel half and lower memory */
+uintptr_t
+page_dir_create(void)
+{
+        uintptr_t frame = (uintptr_t)pmm_alloc();
+        if (!frame)
+                return 0;
+
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        pd_entry_t *dir = page_scratch_map(PAGE_SCRATCH_DIR, frame);
+
+        memset(dir, 0, PAGE_FRAME_SIZE);
+        dir[0] = kernel_directory[0];
+        memcpy(dir + PAGE_KERNEL_INDEX, kernel_directory + PAGE_KERNEL_INDEX,
+               (NUM_OF_ENTRIES - 1 - PAGE_KERNEL_INDEX) * sizeof(pd_entry_t));
+        pd_add_table(dir + NUM_OF_ENTRIES - 1, (page_entry_t*)frame,
+                     PD_PRESENT | PD_READ_WRITE | PD_USER);
+        
+        page_scratch_unmap(PAGE_SCRATCH_DIR);
+        spin_unlock_irqrestore(&page_lock, flags);
+
+        DPRINTF("[PAGING] page directory created at 0x%x\n", frame);
+        return frame;
+}
+
+/* kernel stacks can be in tables that were created after page_dir,
+   so the kernel half has to be up to date before switching to it, a fault
+   on the stack itself couldn't be handled.
+   WARNING! called with the scheduler locked, it doesn't take page_lock,
+   every cpu has its own scratch slot. Returns the version page_dir
+   is up to date with */
+uint32_t
+page_dir_sync(uintptr_t page_dir, uint32_t version)
+{
+        uint32_t current_version = __atomic_load_n(&kernel_pde_version, __ATOMIC_ACQUIRE);
+        if (page_dir == kernel_page_dir || version == current_version)
+                return version;
+
+        uint32_t slot = PAGE_SCRATCH_SYNC + cpu_current()->id;
+        pd_entry_t *dir = page_scratch_map(slot, page_dir);
+        memcpy(dir + PAGE_KERNEL_INDEX, kernel_directory + PAGE_KERNEL_INDEX,
+               (NUM_OF_ENTRIES - 1 - PAGE_KERNEL_INDEX) * sizeof(pd_entry_t));
+        page_scratch_unmap(slot);
+
+        /* a table added while copying is copied at the next switch */
+        return current_version;
+}
+
+/* user half of the current address space is shared with the new one,
+   writable pages become read only copy on write pages in both. Returns
+   0 if there isn't enough memory, the parent pages can stay copy on
+   write, the fault handler makes the last user writable again */
+uintptr_t
+page_dir_fork(void)
+{
+        uintptr_t frame = page_dir_create();
+        if (!frame)
+                return 0;
+
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        pd_entry_t *dir = page_scratch_map(PAGE_SCRATCH_DIR, frame);
+
+        /* lower memory is shared, it's already in the new directory */
+        for (uint32_t pd_index = 1; pd_index < PAGE_KERNEL_INDEX; ++pd_index) {
+                pd_entry_t pd_entry = page_directory[pd_index];
+                if (~pd_entry & PD_PRESENT)
+                        continue;
+
+                if (pd_entry & PD_PAGESIZE) {
+                        dir[pd_index] = pd_entry;
+                        continue;
+                }
+
+                uintptr_t table_frame = (uintptr_t)pmm_alloc();
+                if (!table_frame) {
+                        page_scratch_unmap(PAGE_SCRATCH_DIR);
+                        page_flush_all();
+                        spin_unlock_irqrestore(&page_lock, flags);
+
+                        /* tables already copied and their shared frames */
+                        page_dir_destroy(frame);
+                        return 0;
+                }
+
+                page_entry_t *table = page_scratch_map(PAGE_SCRATCH_TABLE, table_frame);
+                page_entry_t *parent = (page_entry_t*)RECURSIVE_INDEX(pd_index);
+
+                for (uint32_t i = 0; i < NUM_OF_ENTRIES; ++i) {
+                        if (~parent[i] & PT_PRESENT) {
+                                table[i] = 0;
+                                continue;
+                        }
+                        
+                        if (parent[i] & PT_READ_WRITE)
+                                parent[i] = (parent[i] & ~PT_READ_WRITE) | PT_COW;
+                        
+                        table[i] = parent[i];
+                        pmm_frame_share((void*)(parent[i] & ~(PAGE_FRAME_SIZE - 1)));
+                }
+
+                page_scratch_unmap(PAGE_SCRATCH_TABLE);
+                pd_add_table(dir + pd_index, (page_entry_t*)table_frame,
+                             pd_entry & (PAGE_FRAME_SIZE - 1));
+        }
+
+        page_scratch_unmap(PAGE_SCRATCH_DIR);
+        
+        /* parent pages became read only */
+        page_flush_all();
+        spin_unlock_irqrestore(&page_lock, flags);
+
+        return frame;
+}
+
+/* WARNING! page_dir can't be the current page directory */
+void
+page_dir_destroy(uintptr_t page_dir)
+{
+        uint32_t flags = spin_lock_irqsave(&page_lock);
+        pd_entry_t *dir = page_scratch_map(PAGE_SCRATCH_DIR, page_dir);
+
+        for (uint32_t pd_index = 1; pd_index < PAGE_KERNEL_INDEX; ++pd_index) {
+                pd_entry_t pd_entry = dir[pd_index];
+                if (~pd_entry & PD_PRESENT || pd_entry & PD_PAGESIZE)
+                        continue;
+
+                void *table_frame = (void*)(pd_entry & ~(PAGE_FRAME_SIZE - 1));
+                page_entry_t *table = page_scratch_map(PAGE_SCRATCH_TABLE, (uintptr_t)table_frame);
+                
+                for (uint32_t i = 0; i < NUM_OF_ENTRIES; ++i)
+                        if (table[i] & PT_PRESENT)
+                                pmm_frame_release((void*)(table[i] & ~(PAGE_FRAME_SIZE - 1)));
+
+                page_scratch_unmap(PAGE_SCRATCH_TABLE);
+                pmm_free(table_frame);
+        }
+
+        page_scratch_unmap(PAGE_SCRATCH_DIR);
+        spin_unlock_irqrestore(&page_lock, flags);
+
+        pmm_free((void*)page_dir);
+}
+
+/* write to a copy on write page, the last address space that uses
+   the frame can simply make it writable again */
+int
+page_handle_cow(uintptr_t addr)
+{
+        page_entry_t *page_table = page_get_pt(page_directory, addr, NO_ALLOC);
+        if (!page_table)
+                return -1;
+
+        page_entry_t *pt_entry = page_table + page_get_pt_index(addr);
+        if ((*pt_entry & (PT_PRESENT | PT_COW)) != (PT_PRESENT | PT_COW))
+                return -1;
+
+        addr &= ~(PAGE_FRAME_SIZE - 1);
+        void *frame = (void*)(*pt_entry & ~(PAGE_FRAME_SIZE - 1));
+        pt_flags_t flags = (*pt_entry & (PAGE_FRAME_SIZE - 1) & ~PT_COW) | PT_READ_WRITE;
+
+        uint32_t lock_flags = spin_lock_irqsave(&page_lock);
+        if (!pmm_frame_shared(frame)) {
+                pt_add_entry(pt_entry, frame, flags);
+                page_invalidate(addr);
+                spin_unlock_irqrestore(&page_lock, lock_flags);
+                return 0;
+        }
+
+        void *new_frame = pmm_alloc();
+        if (!new_frame) {
+                spin_unlock_irqrestore(&page_lock, lock_flags);
+                return -1;
+        }
+
+        void *copy = page_scratch_map(PAGE_SCRATCH_COPY, (uintptr_t)new_frame);
+        memcpy(copy, (void*)addr, PAGE_FRAME_SIZE);
+        page_scratch_unmap(PAGE_SCRATCH_COPY);
+
+        pt_add_entry(pt_entry, new_frame, flags);
+        page_invalidate(addr);
+        pmm_frame_release(frame);
+        spin_unlock_irqrestore(&page_lock, lock_flags);
+
+        DPRINTF("[PAGING] copy on write of page 0x%x, new frame 0x%x\n", addr, new_frame);
+        return 0;
+}
+
+/* first access to an anonymous page, a zeroed frame is mapped.
+   another cpu of the same address space can fault on the page at the
+   same time, so the page table is checked again under the lock */
+static int
+page_demand_zero(uintptr_t addr, pt_flags_t flags)
+{
+        addr &= ~(PAGE_FRAME_SIZE - 1);
+        page_flush_t flush = {0};
+        uint32_t lock_flags = spin_lock_irqsave(&page_lock);
+
+        /* another cpu faulted on the same page and mapped it first */
+        page_entry_t *page_table = page_get_pt(page_directory, addr, NO_ALLOC);
+        if (page_table && page_table[page_get_pt_index(addr)] & PT_PRESENT) {
+                spin_unlock_irqrestore(&page_lock, lock_flags);
+                return 0;
+        }
+
+        void *frame = pmm_alloc();
+        if (!frame || page_map_locked(page_directory, addr, frame, flags, &flush)) {
+                if (frame)
+                        pmm_free(frame);
+                spin_unlock_irqrestore(&page_lock, lock_flags);
+                return -1;
+        }
+
+        memset((void*)addr, 0, PAGE_FRAME_SIZE);
+        spin_unlock_irqrestore(&page_lock, lock_flags);
+        page_flush_finish(&flush);
+
+        DPRINTF("[PAGING] demand zero page 0x%x, frame 0x%x\n", addr, frame);
+        return 0;
+}
+
+/* the user stack is reserved in every user address space,
+   its pages are mapped the first time they are touched */
+static inline int
+page_is_user_stack(uintptr_t addr)
+{
+        return current_task && current_task->page_dir != kernel_page_dir &&
+                addr >= USER_STACK_TOP - USER_STACK_SIZE && addr < USER_STACK_TOP;
+}
+
+/* returns 0 if the fault has been resolved */
+int
+page_fault_handler(uintptr_t addr, uint32_t error_code)
+{
+        /* kernel table that this address space hasn't copied yet */
+        if (~page_directory[page_get_pd_index(addr)] & PD_PRESENT &&
+            page_sync_kernel_pde(addr))
+                return 0;
+
+        if (error_code & PF_PRESENT) {
+                if (error_code & PF_WRITE && addr < KERNEL_OFFSET)
+                        return page_handle_cow(addr);
+
+                return -1;
+        }
+
+        if (page_is_user_stack(addr) || vmm_is_demand_addr(addr))
+                return page_demand_zero(addr, PT_READ_WRITE | PT_USER);
+
+        return -1;
+}
 
 void
 page_init(void)
@@ -140,13 +756,31 @@ page_init(void)
         /* recursive paging */
         pd_add_table(page_directory + NUM_OF_ENTRIES - 1, CVIR2PHY(page_directory),
                      PD_PRESENT | PD_READ_WRITE | PD_USER);
+
+        kernel_directory = page_directory;
+        kernel_page_dir = VIR2PHY((uintptr_t)page_directory);
+        
+        pd_add_table(page_directory + page_get_pd_index(PAGE_SCRATCH_START),
+                     CVIR2PHY(scratch_table), PD_PRESENT | PD_READ_WRITE);
         
         /* identity mapping all lower memory for easier access to ports,
-           using static allocated page table because there isn't anyway to 
-           allocate pages yet, don't confuse page_table1 with table in boot.S
-           with similar name */
-        pd_add_table(page_directory + 0, CVIR2PHY(page_table1), PD_PRESENT | PD_READ_WRITE | PD_USER);
-        page_identity_pte((page_entry_t*)&page_table1, 0, UPPER_MEMORY_START);
+           a single 4 MiB page is enough and there isn't any page table.
+           it's copied into every address space, so it's kernel only */
+        page_identity_map_large(page_directory, 0, PD_READ_WRITE);
+
+        page_directory = PAGE_RECURSIVE_DIR;
 
         kprintf("[PAGING] setup COMPLETE\n");
 }
+
+/* the other cpus are started after this, so they never miss a shootdown */
+void
+page_shootdown_init(void)
+{
+        kprintf("[PAGING] TLB shootdown setup STARTING\n");
+
+        idt_create(idt_entries + PAGE_SHOOTDOWN_VECTOR, (uintptr_t) page_shootdown_handler,
+                   IDT_PRESENT | IDT_32B_INT);
+
+        kprintf("[PAGING] TLB shootdown setup COMPLETE\n");
+}
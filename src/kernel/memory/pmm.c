@@ -4,16 +4,38 @@
 #include <string.h>
 
 #include <kernel/pmm.h>
+#include <kernel/buddy.h>
 #include <kernel/multiboot.h>
 #include <kernel/memory.h>
 #include <kernel/page.h>
+#include <kernel/vmm.h>
 #include <kernel/debug.h>
+#include <kernel/spinlock.h>
 
 extern char _kernel_start, _kernel_end;
 
 multiboot_info_t *mb_info_ptr;
-static uint8_t *mem_bitmap;
+static uint32_t *mem_bitmap;
+static uint32_t bitmap_words;
 static uint32_t num_of_pages;
+static uint32_t free_pages;
+/* bitmap, summary, free_pages, the buddy zone and frame_refs, buddy.c
+   doesn't have its own lock. Page faults allocate with interrupts
+   disabled so the lock is always taken with interrupts disabled */
+static ticket_lock_t pmm_lock = TICKET_LOCK_INIT;
+
+/* bit n of summary dword i is set if bitmap dword (32 * i + n) has a free page */
+static uint32_t pmm_summary[PMM_SUMMARY_WORDS];
+static uint32_t summary_words;
+
+/* physical memory handed to the buddy allocator, it's set in the bitmap
+   so the single page allocator never touches it */
+static uintptr_t buddy_zone_start;
+static uint32_t buddy_zone_pages;
+
+/* number of address spaces sharing a frame besides the first one,
+   it's only used for copy on write pages */
+static uint16_t *frame_refs;
 
 static uint32_t 
 pmm_detect_upper_memory_size(void)
@@ -46,47 +68,78 @@ pmm_detect_mmap_ptr(void)
         return (mb_mmap_entry_t*) mb_info_ptr->mmap_addr;
 }
 
-static uint8_t
-pmm_index_to_bitmap_ptr(uint8_t **ptr, uint32_t page_index)
+/* a set bit means the page is occupied, the bitmap is accessed a dword
+   at a time, so every dword that is full can be skipped at once */
+static inline uint32_t
+pmm_page_mask(uint32_t page_index)
 {
-        *ptr = mem_bitmap + (page_index / 8);
-        return (page_index % 8);
+        return 1U << (page_index % 32);
 }
 
-
 static void
 pmm_set_bit(uint32_t page_index)
 {
-        uint8_t *page;
-        uint8_t bit = pmm_index_to_bitmap_ptr(&page, page_index);
-        *page |= 1 << bit; 
+        uint32_t word = page_index / 32;
+        uint32_t mask = pmm_page_mask(page_index);
+
+        if (mem_bitmap[word] & mask)
+                return;
+
+        mem_bitmap[word] |= mask;
+        --free_pages;
+
+        /* dword became full, summary doesn't have to point to it anymore */
+        if (mem_bitmap[word] == BIT32_MAX)
+                pmm_summary[word / 32] &= ~pmm_page_mask(word);
 }
 
-/*
 static void
 pmm_set_bits(uint32_t page_index, uint32_t size)
 {
         for (uint32_t i = 0; i < size; ++i)
                 pmm_set_bit(page_index + i);
 }
-*/
 
 static void
 pmm_clear_bit(uint32_t page_index)
 {
-        uint8_t *page;
-        uint8_t bit = pmm_index_to_bitmap_ptr(&page, page_index);
-        *page &= ~(1 << bit);
+        uint32_t word = page_index / 32;
+        uint32_t mask = pmm_page_mask(page_index);
+
+        if (~mem_bitmap[word] & mask)
+                return;
+
+        mem_bitmap[word] &= ~mask;
+        ++free_pages;
+        pmm_summary[word / 32] |= pmm_page_mask(word);
 }
 
-/*
+/* a part of the biggest available region is taken away from the bitmap
+   and given to the buddy allocator, the zone is placed at the end of the
+   region and aligned to the biggest buddy block */
 static void
-pmm_clear_bits(uint32_t page_index, uint32_t size)
+pmm_reserve_buddy_zone(uint64_t region_addr, uint64_t region_size)
 {
-        for (uint32_t i = 0; i < size; ++i)
-                pmm_clear_bit(page_index + i);
+        uint32_t block_size = PAGE_FRAME_SIZE << BUDDY_MAX_ORDER;
+        uint64_t region_end = region_addr + region_size;
+
+        if (region_end > (uint64_t)num_of_pages * PAGE_FRAME_SIZE)
+                region_end = (uint64_t)num_of_pages * PAGE_FRAME_SIZE;
+
+        uint64_t zone_end = region_end & ~(uint64_t)(block_size - 1);
+        uint64_t zone_size = (region_size / PMM_BUDDY_ZONE_DIV) & ~(uint64_t)(block_size - 1);
+
+        if (!zone_size || zone_end < region_addr + zone_size) {
+                kprintf("[PMM] not enough memory for the buddy zone\n");
+                return;
+        }
+
+        buddy_zone_start = zone_end - zone_size;
+        buddy_zone_pages = zone_size / PAGE_FRAME_SIZE;
+        pmm_set_bits(buddy_zone_start / PAGE_FRAME_SIZE, buddy_zone_pages);
+
+        kprintf("[PMM] buddy zone: 0x%x - 0x%x\n", buddy_zone_start, (uint32_t)zone_end);
 }
-*/
 
 /* if the page is free, it is cleared, otherwise it remains set.
    uint32_t occupied_size is the size occupied by kernel and bitmap that 
@@ -96,6 +149,7 @@ pmm_setup_bitmap(mb_mmap_entry_t *mmap_entry, uint32_t occupied_size)
 {
         uint32_t num_of_entries = mb_info_ptr->mmap_length / sizeof(mb_mmap_entry_t);
         mb_mmap_entry_t *last_entry = mmap_entry + num_of_entries;
+        uint64_t biggest_addr = 0, biggest_size = 0;
 
         kprintf("[PMM] MEMORY MAP:\n");
         for (; mmap_entry < last_entry; ++mmap_entry) {
@@ -120,69 +174,61 @@ pmm_setup_bitmap(mb_mmap_entry_t *mmap_entry, uint32_t occupied_size)
                         size -= occupied_size;
                 }
 
-                uint32_t bit = addr / PAGE_FRAME_SIZE;
-                uint32_t end = (addr + size) / PAGE_FRAME_SIZE + 1;
+                /* only whole pages inside the region are usable */
+                uint64_t bit = (addr + PAGE_FRAME_SIZE - 1) / PAGE_FRAME_SIZE;
+                uint64_t end = (addr + size) / PAGE_FRAME_SIZE;
+                if (end > num_of_pages)
+                        end = num_of_pages;
                 
-                for (; bit <= end; ++bit)
+                for (; bit < end; ++bit)
                         pmm_clear_bit(bit);
-        }
-}
 
-/*
-static int
-pmm_is_clear(uint32_t page_index)
-{
-        uint8_t *page;
-        uint8_t bit = pmm_index_to_bitmap_ptr(&page, page_index);
-        return ~(*page >> bit) & 1;
-}
-*/
-
-static int
-pmm_is_set(uint32_t page_index)
-{
-        uint8_t *page;
-        uint8_t bit = pmm_index_to_bitmap_ptr(&page, page_index);
-        return (*page >> bit) & 1;
-}
+                if (size > biggest_size) {
+                        biggest_addr = addr;
+                        biggest_size = size;
+                }
+        }
 
-/* this function exists because the allocator has to loop back when 
-   hitting the end instead to going further, this helper functions makes
-   my life easier */
-static uint32_t
-pmm_add(uint32_t *last_allocated, uint32_t value)
-{
-        *last_allocated = (*last_allocated + value) % num_of_pages;
-        return *last_allocated;
+        pmm_reserve_buddy_zone(biggest_addr, biggest_size);
 }
 
-static inline uint32_t*
-pmm_get_dword(uint32_t page_index)
+/* first set bit in word at position >= from, 32 if there isn't any */
+static inline uint32_t
+pmm_first_set(uint32_t word, uint32_t from)
 {
-        return (uint32_t*)mem_bitmap + (page_index / 32);
+        word &= BIT32_MAX << from;
+        return (word) ? (uint32_t)__builtin_ctz(word) : 32;
 }
 
+/* the summary is searched instead of the bitmap, every bit of the summary
+   is a dword of the bitmap with at least one free page, so the search
+   starts from last_alloc and it only loops over summary dwords */
 static uint32_t
 pmm_search_free_page(uint32_t last_alloc)
 {
-        /* searching for a dword that has a free page */
-        uint32_t start = last_alloc;
-        uint32_t *page = pmm_get_dword(last_alloc);
-
-        for (; *page == BIT32_MAX; page = pmm_get_dword(last_alloc)) {
-                pmm_add(&last_alloc, 32);
-                /* to avoid an endless loop, when it loop back to the start
-                   it can be sure that there aren't any free page */
-                if (last_alloc != start) continue;
-                
+        if (!free_pages) {
                 kprintf("[ERROR][PMM] Not enough physical memory\n");
                 return BIT32_MAX;
         }
 
-        /* searching for the free page */
-        for (; pmm_is_set(last_alloc); pmm_add(&last_alloc, 1));
+        uint32_t word = (last_alloc / 32) % bitmap_words;
+        uint32_t group = word / 32;
+        uint32_t bit = pmm_first_set(pmm_summary[group], word % 32);
+
+        /* after looping back the starting group is checked again
+           from its first bit */
+        for (uint32_t i = 1; bit == 32 && i <= summary_words; ++i) {
+                group = (group + 1) % summary_words;
+                bit = pmm_first_set(pmm_summary[group], 0);
+        }
 
-        return last_alloc;
+        if (bit == 32) {
+                printf("[PMM] free page counter and summary differ\n");
+                abort();
+        }
+
+        word = group * 32 + bit;
+        return word * 32 + __builtin_ctz(~mem_bitmap[word]);
 }
 
 void*
@@ -190,44 +236,135 @@ pmm_alloc(void)
 {
         static uint32_t last_alloc = 0;
 
-        last_alloc = pmm_search_free_page(last_alloc);
-        if (last_alloc == BIT32_MAX) return NULL;
-        
-        pmm_set_bit(last_alloc);
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        uint32_t page = pmm_search_free_page(last_alloc);
+        /* bitmap is full, the buddy zone is the last resort */
+        if (page == BIT32_MAX) {
+                void *frame = buddy_alloc(0);
+                ticket_unlock_irqrestore(&pmm_lock, flags);
+                return frame;
+        }
+
+        last_alloc = page;
+        pmm_set_bit(page);
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+
         DPRINTF("[PMM] allocating free page n. 0x%x, address: %x\n",
-                last_alloc, last_alloc * PAGE_FRAME_SIZE);
-        return (void*)(last_alloc * PAGE_FRAME_SIZE);
+                page, page * PAGE_FRAME_SIZE);
+        return (void*)(page * PAGE_FRAME_SIZE);
 }
 
-void
-pmm_free(void *page)
+/* called with the lock held, buddy blocks remember their order */
+static void
+pmm_free_locked(void *page)
 {
+        if (buddy_owns(page)) {
+                buddy_free(page);
+                return;
+        }
+
         uint32_t index = (uintptr_t)page / PAGE_FRAME_SIZE;
         DPRINTF("[PMM] freeing occupied page n. 0x%x, address: %x\n",
                 index, page);
+
         pmm_clear_bit(index);
 }
 
-/* pmm_allocs seems useless for now, because it never has been used for anything */
-/*
+void
+pmm_free(void *page)
+{
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        pmm_free_locked(page);
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/* physically contiguous pages, size is the number of pages and it's
+   rounded up to a power of two by the buddy allocator */
 void*
-pmm_allocs(size_t size)
+pmm_allocs(uint32_t size)
 {
-        static uint32_t last_alloc = 0;
         if (!size) return NULL;
+        if (size == 1) return pmm_alloc();
+
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        void *page = buddy_alloc(buddy_order(size));
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+
+        if (!page)
+                kprintf("[ERROR][PMM] can't allocate %d contiguous pages\n", size);
+
+        return page;
+}
+
+void
+pmm_frees(void *page, uint32_t size)
+{
+        if (size == 1 || !buddy_owns(page)) {
+                pmm_free(page);
+                return;
+        }
+
+        /* buddy allocator remembers the order of the block */
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        buddy_free(page);
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+}
 
-        last_alloc = pmm_search_free_page(last_alloc);
+uint32_t
+pmm_free_pages(void)
+{
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        uint32_t pages = free_pages + buddy_free_pages();
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+
+        return pages;
+}
+
+void
+pmm_frame_share(void *frame)
+{
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+        ++frame_refs[(uintptr_t)frame / PAGE_FRAME_SIZE];
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+}
+
+uint32_t
+pmm_frame_shared(void *frame)
+{
+        return __atomic_load_n(&frame_refs[(uintptr_t)frame / PAGE_FRAME_SIZE],
+                               __ATOMIC_RELAXED);
+}
+
+/* the frame is freed when the last address space releases it */
+void
+pmm_frame_release(void *frame)
+{
+        uint16_t *refs = &frame_refs[(uintptr_t)frame / PAGE_FRAME_SIZE];
+        uint32_t flags = ticket_lock_irqsave(&pmm_lock);
+
+        if (*refs)
+                --*refs;
+        else
+                pmm_free_locked(frame);
+
+        ticket_unlock_irqrestore(&pmm_lock, flags);
+}
+
+/* buddy allocator needs kmalloc for its metadata, so it can only be
+   set up after vmm_init */
+void
+pmm_buddy_init(void)
+{
+        buddy_init(buddy_zone_start, buddy_zone_pages);
 }
-*/
 
-/*
+/* needs kmalloc too, like the buddy allocator */
 void
-pmm_frees(void *page, size_t size)
+pmm_refs_init(void)
 {
-        uint32_t index = (uintptr_t)page_frame / PAGE_FRAME_SIZE;
-        pmm_clear_bits(index, size);
+        frame_refs = kmalloc(sizeof(uint16_t) * num_of_pages);
+        memset(frame_refs, 0, sizeof(uint16_t) * num_of_pages);
 }
-*/
 
 void
 pmm_init(void)
@@ -242,25 +379,31 @@ pmm_init(void)
         num_of_pages = memory_size >> 2;
         kprintf("[PMM] total num of pages: 0x%x (%d)\n", num_of_pages, num_of_pages);
 
-        /* num_of_pages / 8 because a byte can contain info about 8 pages */
-        uint32_t bitmap_size = num_of_pages >> 3;
+        /* a dword can contain info about 32 pages */
+        bitmap_words = (num_of_pages + 31) / 32;
+        summary_words = (bitmap_words + 31) / 32;
+        uint32_t bitmap_size = bitmap_words * sizeof(uint32_t);
         kprintf("[PMM] BITMAP size: 0x%x bytes\n", bitmap_size);
 
         uintptr_t kernel_start = (uintptr_t)&_kernel_start;
         uintptr_t kernel_end = (uintptr_t)&_kernel_end;
  
         uint32_t kernel_size = kernel_end - PHY2VIR(kernel_start);
-        uint32_t total_size = bitmap_size + kernel_size + kernel_start;
+        uint32_t total_size = bitmap_size + sizeof(uint32_t) + kernel_size + kernel_start;
         kprintf("[PMM] KERNEL size: 0x%x bytes\n", kernel_size);
         kprintf("[PMM] TOTAL occupied size: 0x%x bytes\n", total_size);
 
-        mem_bitmap = (uint8_t*)kernel_end + 1;
-        /* setting all the bitmap occupied */
+        mem_bitmap = (uint32_t*)ALIGN_ADDR(kernel_end + 1, sizeof(uint32_t));
+        /* setting all the bitmap occupied, summary is empty and
+           it gets filled while clearing the bitmap */
         memset(mem_bitmap, 0xFF, bitmap_size);
+        memset(pmm_summary, 0, sizeof(pmm_summary));
+        free_pages = 0;
 
         /* clear the bitmap according to the memory map */
         mb_mmap_entry_t *mmap_head = pmm_detect_mmap_ptr();
         pmm_setup_bitmap(mmap_head, total_size);
+        kprintf("[PMM] free pages: 0x%x (%d)\n", free_pages, free_pages);
         
         kprintf("[PMM] setup COMPLETE\n");
 }
@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <kernel/slab.h>
+#include <kernel/vmm.h>
+#include <kernel/memory.h>
+#include <kernel/debug.h>
+
+/* every cache that has been created, only used to print info */
+static kmem_cache_t *caches = NULL;
+static spinlock_t caches_lock = SPINLOCK_INIT;
+
+static void
+slab_list_push(kmem_slab_t **head, kmem_slab_t *slab)
+{
+        slab->prev = NULL;
+        slab->next = *head;
+        if (*head)
+                (*head)->prev = slab;
+
+        *head = slab;
+}
+
+static void
+slab_list_remove(kmem_slab_t **head, kmem_slab_t *slab)
+{
+        if (slab->prev)
+                slab->prev->next = slab->next;
+        else
+                *head = slab->next;
+
+        if (slab->next)
+                slab->next->prev = slab->prev;
+
+        slab->next = NULL;
+        slab->prev = NULL;
+}
+
+/* the slab header is found by masking the object address, that's why
+   slabs have to be page aligned pages from the block allocator */
+static inline kmem_slab_t*
+slab_from_obj(void *obj)
+{
+        return (kmem_slab_t*)((uintptr_t)obj & ~(PAGE_FRAME_SIZE - 1));
+}
+
+static kmem_slab_t*
+slab_create(kmem_cache_t *cache)
+{
+        kmem_slab_t *slab = kmalloc(PAGE_FRAME_SIZE);
+        if (!slab)
+                return NULL;
+
+        if ((uintptr_t)slab & (PAGE_FRAME_SIZE - 1)) {
+                kprintf("[ERROR][SLAB] slab for cache %s isn't page aligned\n",
+                        cache->name);
+                kfree(slab);
+                return NULL;
+        }
+
+        slab->cache = cache;
+        slab->used = 0;
+        slab->next = NULL;
+        slab->prev = NULL;
+
+        /* the free list is threaded through the objects themselves */
+        uintptr_t obj = ALIGN_ADDR((uintptr_t)slab + sizeof(kmem_slab_t), SLAB_ALIGN);
+        slab->free = (void*)obj;
+        for (uint32_t i = 1; i < cache->objs_per_slab; ++i, obj += cache->size)
+                *(void**)obj = (void*)(obj + cache->size);
+        *(void**)obj = NULL;
+
+        ++cache->slabs;
+        DPRINTF("[SLAB] new slab for cache %s at address %x\n", cache->name, slab);
+        return slab;
+}
+
+kmem_cache_t*
+kmem_cache_create(const char *name, size_t size)
+{
+        size_t header = ALIGN_ADDR(sizeof(kmem_slab_t), SLAB_ALIGN);
+        size = ALIGN_ADDR(size, SLAB_ALIGN);
+
+        if (size > PAGE_FRAME_SIZE - header) {
+                printf("[SLAB] object of cache %s doesn't fit in a slab\n", name);
+                abort();
+        }
+
+        kmem_cache_t *cache = kmalloc(sizeof(kmem_cache_t));
+        cache->lock = (spinlock_t) SPINLOCK_INIT;
+        cache->name = name;
+        cache->size = size;
+        cache->objs_per_slab = (PAGE_FRAME_SIZE - header) / size;
+        cache->partial = NULL;
+        cache->full = NULL;
+        cache->empty = NULL;
+        cache->slabs = 0;
+        cache->allocated = 0;
+
+        uint32_t flags = spin_lock_irqsave(&caches_lock);
+        cache->next = caches;
+        caches = cache;
+        spin_unlock_irqrestore(&caches_lock, flags);
+
+        kprintf("[SLAB] cache %s created, object size: %d, objects per slab: %d\n",
+                name, size, cache->objs_per_slab);
+        return cache;
+}
+
+void*
+kmem_cache_alloc(kmem_cache_t *cache)
+{
+        uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+        kmem_slab_t *slab = cache->partial;
+        if (!slab) {
+                /* an empty slab is used before asking for a new page */
+                slab = cache->empty;
+                if (slab)
+                        slab_list_remove(&cache->empty, slab);
+                else
+                        slab = slab_create(cache);
+
+                if (!slab) {
+                        spin_unlock_irqrestore(&cache->lock, flags);
+                        kprintf("[ERROR][SLAB] cache %s can't grow\n", cache->name);
+                        return NULL;
+                }
+
+                slab_list_push(&cache->partial, slab);
+        }
+
+        void *obj = slab->free;
+        slab->free = *(void**)obj;
+        ++slab->used;
+        ++cache->allocated;
+
+        if (slab->used == cache->objs_per_slab) {
+                slab_list_remove(&cache->partial, slab);
+                slab_list_push(&cache->full, slab);
+        }
+
+        spin_unlock_irqrestore(&cache->lock, flags);
+
+        DPRINTF("[SLAB] allocated object of cache %s at address %x\n",
+                cache->name, obj);
+        return obj;
+}
+
+/* empty slabs are kept in the cache, so a cache never shrinks */
+void
+kmem_cache_free(kmem_cache_t *cache, void *obj)
+{
+        if (!obj)
+                return;
+
+        kmem_slab_t *slab = slab_from_obj(obj);
+        if (slab->cache != cache || !slab->used) {
+                printf("[SLAB] object %x doesn't belong to cache %s\n", obj, cache->name);
+                abort();
+        }
+
+        uint32_t flags = spin_lock_irqsave(&cache->lock);
+
+        if (slab->used == cache->objs_per_slab) {
+                slab_list_remove(&cache->full, slab);
+                slab_list_push(&cache->partial, slab);
+        }
+
+        *(void**)obj = slab->free;
+        slab->free = obj;
+        --slab->used;
+        --cache->allocated;
+
+        if (!slab->used) {
+                slab_list_remove(&cache->partial, slab);
+                slab_list_push(&cache->empty, slab);
+        }
+
+        spin_unlock_irqrestore(&cache->lock, flags);
+
+        DPRINTF("[SLAB] freed object of cache %s at address %x\n", cache->name, obj);
+}
+
+void
+kmem_cache_print_info(void)
+{
+        uint32_t flags = spin_lock_irqsave(&caches_lock);
+        kmem_cache_t *first = caches;
+        spin_unlock_irqrestore(&caches_lock, flags);
+
+        /* caches are never destroyed, new ones are only added at the head */
+        for (kmem_cache_t *cache = first; cache; cache = cache->next)
+                kprintf("[SLAB] %s: size %d, slabs %d, objects %d / %d\n",
+                        cache->name, cache->size, cache->slabs, cache->allocated,
+                        cache->slabs * cache->objs_per_slab);
+}
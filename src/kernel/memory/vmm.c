@@ -1,25 +1,67 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stddef.h>
+#include <stdlib.h>
 
 #include <kernel/vmm.h>
 #include <kernel/page.h>
 #include <kernel/memory.h>
+#include <kernel/pmm.h>
+#include <kernel/spinlock.h>
 #include <kernel/debug.h>
 
 static node_t *kheap_head;
 static uintptr_t kheap_start;
 static uintptr_t kheap_end;
 
-static node_t *kheap_stack_last;
 static uintptr_t kheap_stack_start;
 static uintptr_t kheap_stack_end;
 
+/* freed pages of the block heap are kept on a stack, the link to the
+   next free page is stored in the free page itself */
+static uintptr_t kheap_block_free;
+static uint32_t kheap_block_cached;
+/* pages given back to the PMM are unmapped, so the link to the next
+   hole is stored in their not present page table entry */
+static uintptr_t kheap_block_holes;
+
+/* free lists of the size classes, they contain the pointers returned
+   by kmalloc, the size header before each pointer is never touched */
+static void *kheap_classes[VMM_CLASSES];
+
+/* free page runs by length, linked through the pointers returned by
+   kmalloc like the size classes, they stay mapped */
+static void *kheap_runs[VMM_RUN_MAX + 1];
+
+static vmm_stats_t kheap_stats;
+
+/* the heaps are shared by every cpu, the lock is taken with interrupts
+   disabled because slab caches grow with kmalloc in the fpu trap */
+static spinlock_t kheap_lock = SPINLOCK_INIT;
+
+static inline uint64_t
+vmm_rdtsc(void)
+{
+        uint32_t low, high;
+        asm volatile ("rdtsc" : "=a" (low), "=d" (high));
+        return ((uint64_t)high << 32) | low;
+}
+
+static inline void
+vmm_stats_alloc(size_t size)
+{
+        kheap_stats.bytes_allocated += size;
+        if (kheap_stats.bytes_allocated > kheap_stats.bytes_peak)
+                kheap_stats.bytes_peak = kheap_stats.bytes_allocated;
+}
+
 static void
 vmm_kheap_list_init(uintptr_t heap_start)
 {
         kprintf("[VMM] kernel heap placed at address 0x%x\n", heap_start);
         
+        /* the first page is touched before the page fault handler is
+           installed, so it's the only one that is mapped immediately */
         page_get_pt_entry(page_directory, heap_start, PAGE_ALLOC);
         kheap_start = heap_start;
         kheap_end = heap_start + PAGE_FRAME_SIZE;
@@ -83,6 +125,7 @@ vmm_get_node(node_t *node, node_t **prev, size_t size)
 static void*
 vmm_list_alloc(size_t size)
 {
+        uint64_t start = vmm_rdtsc();
         node_t *prev = NULL;
         size += sizeof(size_t);
         node_t *node = vmm_get_node(kheap_head, &prev, size);
@@ -90,13 +133,16 @@ vmm_list_alloc(size_t size)
         /* if the kheap can't accommodate the request, the kheap is enlarged */
         while (!node) {
 
-                if (kheap_end > kheap_stack_end) {
+                if (kheap_end + PAGE_FRAME_SIZE > kheap_stack_end) {
                         kprintf("kheap overflowed into kheap stack\n");
+                        kheap_stats.list_alloc_cycles += vmm_rdtsc() - start;
                         return NULL;
                 }
-                page_get_pt_entry(page_directory, kheap_end, PAGE_ALLOC);
-
+                /* the page isn't mapped here, writing the node header
+                   faults and the page fault handler maps a zeroed frame */
                 node_t *new_node = (node_t*)kheap_end;
+                kheap_end += PAGE_FRAME_SIZE;
+
                 new_node->size = PAGE_FRAME_SIZE - sizeof(node_t);
                 new_node->next = NULL;
 
@@ -106,7 +152,6 @@ vmm_list_alloc(size_t size)
                 for (; tmp->next; tmp = tmp->next);
                 tmp->next = new_node;
                 
-                kheap_end += PAGE_FRAME_SIZE;
                 vmm_merge_free_block(kheap_head);
 
                 node = vmm_get_node(kheap_head, &prev, size);
@@ -127,12 +172,24 @@ vmm_list_alloc(size_t size)
 
         *size_ptr = size;
 
+        vmm_stats_alloc(size);
+        ++kheap_stats.list_allocs;
+        kheap_stats.list_alloc_cycles += vmm_rdtsc() - start;
+
         DPRINTF("[VMM] allocated 0x%x bytes of memory at address 0x%x\n",
                 size, size_ptr + 1);
 
         return (void*)(size_ptr + 1);
 }
 
+/* the list heap is mapped on demand, pages are backed by a frame
+   only when they are first touched */
+int
+vmm_is_demand_addr(uintptr_t addr)
+{
+        return addr >= kheap_start && addr < kheap_end;
+}
+
 static void
 vmm_kheap_stack_init(uintptr_t heap_stack_start)
 {
@@ -141,89 +198,301 @@ vmm_kheap_stack_init(uintptr_t heap_stack_start)
         kheap_stack_end = heap_stack_start;
         page_get_pt_entry(page_directory, kheap_stack_end, PAGE_ALLOC);
         
-        kheap_stack_last = kmalloc(sizeof(node_t));
-        kheap_stack_last->addr = kheap_stack_end;
-        kheap_stack_last->next = NULL;
+        /* the first page is already mapped, so it starts as a free page */
+        *(uintptr_t*)kheap_stack_end = 0;
+        kheap_block_free = kheap_stack_end;
+        kheap_block_cached = 1;
+        kheap_block_holes = 0;
 }
 
-/* it only allocates page sized memory block, it behaves like a stack 
-   with nodes containing info about free pages */
+/* page table is always present, the page was mapped before becoming a hole */
+static inline page_entry_t*
+vmm_block_pte(uintptr_t addr)
+{
+        return page_get_pt(page_directory, addr, NO_ALLOC) + page_get_pt_index(addr);
+}
+
+/* it only allocates page sized memory block: first from the free pages
+   stack, then from the holes left by unmapped pages and only after that
+   the block heap is enlarged */
 static void*
 vmm_block_alloc(void)
 {
-        if (kheap_stack_end < kheap_end) {
+        uintptr_t addr;
+
+        if (kheap_block_free) {
+                addr = kheap_block_free;
+                kheap_block_free = *(uintptr_t*)addr;
+                --kheap_block_cached;
+
+        } else if (kheap_block_holes) {
+                addr = kheap_block_holes;
+                kheap_block_holes = *vmm_block_pte(addr);
+
+                void *frame = pmm_alloc();
+                if (!frame) {
+                        kheap_block_holes = addr;
+                        return NULL;
+                }
+
+                page_map(page_directory, addr, frame, PT_READ_WRITE | PT_USER);
+
+        } else {
+                if (kheap_stack_end - PAGE_FRAME_SIZE < kheap_end) {
+                        kprintf("[ERROR][VMM] page stack overflowed in kheap\n");
+                        return NULL;
+                }
+
+                kheap_stack_end -= PAGE_FRAME_SIZE;
+                page_get_pt_entry(page_directory, kheap_stack_end, PAGE_ALLOC);
+                addr = kheap_stack_end;
+        }
+
+        DPRINTF("[VMM] allocated 0x1000 bytes of memory at address 0x%x\n", addr);
+        return (void*)addr;
+}
+
+/* a few free pages stay mapped for fast reuse, the frames of the
+   others go back to the PMM. Returns the page that has to be released
+   after the heap lock, 0 if it has been cached */
+static uintptr_t
+vmm_block_free(uintptr_t addr)
+{
+        kheap_stats.bytes_allocated -= PAGE_FRAME_SIZE;
+        ++kheap_stats.block_frees;
+
+        if (kheap_block_cached < VMM_BLOCK_CACHED_MAX) {
+                *(uintptr_t*)addr = kheap_block_free;
+                kheap_block_free = addr;
+                ++kheap_block_cached;
+                return 0;
+        }
+
+        return addr;
+}
+
+/* page_unmap waits for the other cpus to flush their TLB, so it can't
+   be called with the heap lock. The page becomes a hole only after
+   that, it can't be mapped again while a cpu still has the old frame */
+static void
+vmm_block_release(uintptr_t addr)
+{
+        void *frame = page_unmap(page_directory, addr);
+        pmm_free(frame);
+
+        uint32_t flags = spin_lock_irqsave(&kheap_lock);
+        /* present bit is 0, because addr is page aligned */
+        *vmm_block_pte(addr) = kheap_block_holes;
+        kheap_block_holes = addr;
+        spin_unlock_irqrestore(&kheap_lock, flags);
+
+        DPRINTF("[VMM] page 0x%x unmapped, frame 0x%x freed\n", addr, frame);
+}
+
+/* index of the smallest class that can contain size bytes, header included */
+static inline uint32_t
+vmm_class_index(size_t size)
+{
+        if (size <= VMM_CLASS_MIN)
+                return 0;
+
+        uint32_t shift = 32 - __builtin_clz(size - 1);
+        return shift - VMM_CLASS_MIN_SHIFT;
+}
+
+/* a page from the block heap is split into blocks of the class size,
+   every block starts with the size header like the list allocator */
+static int
+vmm_class_refill(uint32_t index)
+{
+        char *page = vmm_block_alloc();
+        if (!page)
+                return -1;
+
+        size_t size = VMM_CLASS_MIN << index;
+        for (char *block = page; block + size <= page + PAGE_FRAME_SIZE; block += size) {
+                size_t *size_ptr = (size_t*)block;
+                *size_ptr = size;
+
+                void **ptr = (void**)(size_ptr + 1);
+                *ptr = kheap_classes[index];
+                kheap_classes[index] = ptr;
+        }
+
+        DPRINTF("[VMM] class of 0x%x bytes refilled with page 0x%x\n", size, page);
+        return 0;
+}
+
+static void*
+vmm_class_alloc(size_t size)
+{
+        uint32_t index = vmm_class_index(size + sizeof(size_t));
+
+        if (!kheap_classes[index] && vmm_class_refill(index))
+                return NULL;
+
+        void **ptr = kheap_classes[index];
+        kheap_classes[index] = *ptr;
+
+        vmm_stats_alloc(VMM_CLASS_MIN << index);
+        ++kheap_stats.class_allocs[index];
+
+        DPRINTF("[VMM] allocated 0x%x bytes of memory at address 0x%x\n",
+                VMM_CLASS_MIN << index, ptr);
+        return ptr;
+}
+
+/* the header says which class the block belongs to, no search needed */
+static void
+vmm_class_free(void *ptr)
+{
+        size_t size = *((size_t*)ptr - 1);
+        uint32_t index = vmm_class_index(size);
+
+        if (size != (size_t)VMM_CLASS_MIN << index) {
+                printf("[VMM] freeing block with corrupted header: %x\n", ptr);
+                abort();
+        }
+
+        *(void**)ptr = kheap_classes[index];
+        kheap_classes[index] = ptr;
+
+        kheap_stats.bytes_allocated -= size;
+        ++kheap_stats.class_frees[index];
+}
+
+/* the run is taken from the top of the block heap, the free pages
+   stack can't be used because its pages aren't contiguous */
+static void*
+vmm_run_grow(uint32_t pages)
+{
+        uintptr_t size = pages * PAGE_FRAME_SIZE;
+
+        if (kheap_stack_end - size < kheap_end) {
                 kprintf("[ERROR][VMM] page stack overflowed in kheap\n");
                 return NULL;
         }
-        
-        /* if there are free page on stack, allocate the page, if not allocate
-           a new one by enlarging the kheap */
-        if (kheap_stack_last) {
-                node_t *tmp = kheap_stack_last;
-                kheap_stack_last = kheap_stack_last->next;
-                
-                uintptr_t addr = tmp->addr;
-                kfree(tmp);
 
-                DPRINTF("[VMM] allocated 0x1000 bytes of memory at address 0x%x\n",
-                        addr);
-                return (void*)addr;
+        kheap_stack_end -= size;
+        for (uintptr_t addr = kheap_stack_end; addr < kheap_stack_end + size; addr += PAGE_FRAME_SIZE)
+                page_get_pt_entry(page_directory, addr, PAGE_ALLOC);
+
+        return (void*)kheap_stack_end;
+}
+
+/* the header holds the size of the whole run, so kfree knows how many
+   pages it has without any search */
+static void*
+vmm_run_alloc(uint32_t pages)
+{
+        size_t *size_ptr;
+
+        if (pages == 1) {
+                size_ptr = vmm_block_alloc();
+                ++kheap_stats.block_allocs;
+        } else if (kheap_runs[pages]) {
+                void **ptr = kheap_runs[pages];
+                kheap_runs[pages] = *ptr;
+                size_ptr = (size_t*)ptr - 1;
+                ++kheap_stats.run_allocs;
+        } else {
+                size_ptr = vmm_run_grow(pages);
+                ++kheap_stats.run_allocs;
         }
 
-        kheap_stack_end -= PAGE_FRAME_SIZE;
-        page_get_pt_entry(page_directory, kheap_stack_end, PAGE_ALLOC);
+        if (!size_ptr)
+                return NULL;
 
-        DPRINTF("[VMM] allocated 0x1000 bytes of memory at address 0x%x\n",
-                kheap_stack_end);
+        *size_ptr = pages * PAGE_FRAME_SIZE;
+        vmm_stats_alloc(*size_ptr);
 
-        return (void*)kheap_stack_end;
+        DPRINTF("[VMM] allocated 0x%x bytes of memory at address 0x%x\n",
+                *size_ptr, size_ptr + 1);
+        return size_ptr + 1;
 }
 
-/* there are two allocator, one exclusive for page sized memory, while other one
-   is for general usage. */
-void*
-kmalloc(size_t size)
+/* a single page goes back to the block heap, longer runs go on the
+   list of their length. Returns the page to release like vmm_block_free */
+static uintptr_t
+vmm_run_free(void *ptr)
+{
+        size_t size = *((size_t*)ptr - 1);
+        uint32_t pages = size / PAGE_FRAME_SIZE;
+
+        if (size & (PAGE_FRAME_SIZE - 1) || !pages || pages > VMM_RUN_MAX) {
+                printf("[VMM] freeing block with corrupted header: %x\n", ptr);
+                abort();
+        }
+
+        if (pages == 1)
+                return vmm_block_free((uintptr_t)ptr & ~(PAGE_FRAME_SIZE - 1));
+
+        *(void**)ptr = kheap_runs[pages];
+        kheap_runs[pages] = ptr;
+
+        kheap_stats.bytes_allocated -= size;
+        ++kheap_stats.run_frees;
+        return 0;
+}
+
+/* there are four allocators: one exclusive for page sized memory, the
+   size classes for small memory blocks, runs of whole pages for bigger
+   blocks, and the list allocator only for blocks longer than any run */
+static void*
+vmm_alloc(size_t size)
 {
         if (!size) return NULL;
        
         if (size == PAGE_FRAME_SIZE) {
                 void *ptr = vmm_block_alloc();
                 
-                if (ptr)
+                if (ptr) {
+                    vmm_stats_alloc(PAGE_FRAME_SIZE);
+                    ++kheap_stats.block_allocs;
                     return ptr;
+                }
         }
 
-        return vmm_list_alloc(size);
+        if (size + sizeof(size_t) <= VMM_CLASS_MAX)
+                return vmm_class_alloc(size);
+
+        size = ALIGN_ADDR(size + sizeof(size_t), PAGE_FRAME_SIZE);
+        if (size / PAGE_FRAME_SIZE <= VMM_RUN_MAX)
+                return vmm_run_alloc(size / PAGE_FRAME_SIZE);
+
+        return vmm_list_alloc(size - sizeof(size_t));
 }
 
-void
-kfree(void *ptr)
+/* returns the page that has to be released, see vmm_block_free */
+static uintptr_t
+vmm_free(void *ptr)
 {
         uintptr_t ptr_addr = (uintptr_t)ptr;
+        uintptr_t release = 0;
 
         if (ptr_addr < kheap_start || ptr_addr >= kheap_stack_start)
-                return;
-
-        if (ptr_addr > kheap_end) {
+                return 0;
+
+        uint64_t start = vmm_rdtsc();
+
+        if (ptr_addr >= kheap_stack_end && ptr_addr & (PAGE_FRAME_SIZE - 1)) {
+                /* blocks of the size classes and runs are the only ones in
+                   the block heap that aren't page aligned, the header says
+                   which one it is */
+                if (*((size_t*)ptr - 1) <= VMM_CLASS_MAX)
+                        vmm_class_free(ptr);
+                else
+                        release = vmm_run_free(ptr);
+        } else if (ptr_addr >= kheap_stack_end) {
                 /* it's sure that memory is from vmm block allocator */
-
-                uintptr_t page = ptr_addr & ~0xFFF;
-                node_t *node = kmalloc(sizeof(sizeof(node_t)));
-
-                /* REMEMBER: if there is a bug with kfree it's because
-                   of the designated initializer */
-                node = &(node_t) {
-                        .addr = page,
-                        .next = kheap_stack_last,
-                };
-
-                /* freed page get pushed on the stack */
-                kheap_stack_last = node;
+                release = vmm_block_free(ptr_addr);
         } else {
                 /* it's sure that memory is from vmm list allocator */
                 
                 /* makes a new node out of the pointer */
                 node_t *node = (node_t*)((char*)ptr - sizeof(size_t));
+                kheap_stats.bytes_allocated -= node->size;
+                ++kheap_stats.list_frees;
                 node->size -= sizeof(node_t);
                 
                 /* we insert in a sorted list because it easier to merge free blocks */
@@ -231,7 +500,29 @@ kfree(void *ptr)
                 vmm_merge_free_block(kheap_head);        
         }
 
-        ptr = NULL;
+        kheap_stats.kfree_cycles += vmm_rdtsc() - start;
+        return release;
+}
+
+void*
+kmalloc(size_t size)
+{
+        uint32_t flags = spin_lock_irqsave(&kheap_lock);
+        void *ptr = vmm_alloc(size);
+        spin_unlock_irqrestore(&kheap_lock, flags);
+
+        return ptr;
+}
+
+void
+kfree(void *ptr)
+{
+        uint32_t flags = spin_lock_irqsave(&kheap_lock);
+        uintptr_t release = vmm_free(ptr);
+        spin_unlock_irqrestore(&kheap_lock, flags);
+
+        if (release)
+                vmm_block_release(release);
 }
 
 void
@@ -241,6 +532,69 @@ vmm_print_kheap(void)
                 printf("addr: %x, size: %x\n", node, node->size);
 }
         
+/* counters are kept while allocating and freeing, free memory is
+   computed by walking the free lists, with the same lock as kmalloc
+   and kfree so the lists can't change during the walk */
+void
+vmm_get_stats(vmm_stats_t *stats)
+{
+        uint32_t flags = spin_lock_irqsave(&kheap_lock);
+
+        *stats = kheap_stats;
+        stats->bytes_free = 0;
+        stats->largest_free = 0;
+        stats->nodes = 0;
+
+        for (node_t *node = kheap_head; node; node = node->next) {
+                stats->bytes_free += node->size;
+                if (node->size > stats->largest_free)
+                        stats->largest_free = node->size;
+                ++stats->nodes;
+        }
+
+        for (uint32_t i = 0; i < VMM_CLASSES; ++i)
+                for (void **ptr = kheap_classes[i]; ptr; ptr = *ptr)
+                        stats->bytes_free += VMM_CLASS_MIN << i;
+
+        stats->bytes_free += kheap_block_cached * PAGE_FRAME_SIZE;
+        if (kheap_block_cached && stats->largest_free < PAGE_FRAME_SIZE)
+                stats->largest_free = PAGE_FRAME_SIZE;
+
+        for (uint32_t pages = 2; pages <= VMM_RUN_MAX; ++pages) {
+                for (void **ptr = kheap_runs[pages]; ptr; ptr = *ptr)
+                        stats->bytes_free += pages * PAGE_FRAME_SIZE;
+
+                if (kheap_runs[pages] && stats->largest_free < pages * PAGE_FRAME_SIZE)
+                        stats->largest_free = pages * PAGE_FRAME_SIZE;
+        }
+
+        spin_unlock_irqrestore(&kheap_lock, flags);
+}
+
+/* cycles are printed in thousands, kprintf can't print 64 bit numbers */
+void
+vmm_print_stats(void)
+{
+        vmm_stats_t stats;
+        vmm_get_stats(&stats);
+
+        kprintf("[VMM] heap bytes allocated: %d, peak: %d, free: %d\n",
+                stats.bytes_allocated, stats.bytes_peak, stats.bytes_free);
+        kprintf("[VMM] heap free nodes: %d, largest free block: %d\n",
+                stats.nodes, stats.largest_free);
+        kprintf("[VMM] list allocs: %d, frees: %d\n", stats.list_allocs, stats.list_frees);
+        kprintf("[VMM] block allocs: %d, frees: %d\n", stats.block_allocs, stats.block_frees);
+        kprintf("[VMM] run allocs: %d, frees: %d\n", stats.run_allocs, stats.run_frees);
+
+        for (uint32_t i = 0; i < VMM_CLASSES; ++i)
+                kprintf("[VMM] class %d bytes allocs: %d, frees: %d\n",
+                        VMM_CLASS_MIN << i, stats.class_allocs[i], stats.class_frees[i]);
+
+        kprintf("[VMM] kcycles in list alloc: %d, in kfree: %d\n",
+                (uint32_t)(stats.list_alloc_cycles / 1000),
+                (uint32_t)(stats.kfree_cycles / 1000));
+}
+
 void
 vmm_init(void)
 {
@@ -0,0 +1,217 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <kernel/fpu.h>
+#include <kernel/task.h>
+#include <kernel/smp.h>
+#include <kernel/slab.h>
+#include <kernel/memory.h>
+#include <kernel/spinlock.h>
+
+/* the fpu state is restored lazily, CR0.TS is set when a task gets the
+   cpu and the first fpu or sse instruction raises #NM, that's when the
+   state of the task is loaded. The state of a task that used the fpu
+   is saved when it leaves the cpu, the registers still hold it so it
+   isn't loaded again if the task comes back before anyone else uses
+   the fpu on that cpu */
+
+#define FPU_AREA(task)  ((void*)ALIGN_ADDR((uintptr_t)(task)->fpu_state, FPU_STATE_ALIGN))
+
+static kmem_cache_t *fpu_cache;
+static int fpu_enabled = 0;
+
+/* state after fninit, given to a task the first time it uses the fpu */
+static uint8_t fpu_init_state[FPU_STATE_SIZE] __attribute__((aligned(FPU_STATE_ALIGN)));
+
+static inline uint32_t
+cr0_read(void)
+{
+        uint32_t cr0;
+        asm volatile ("movl %%cr0, %0" : "=r"(cr0));
+        return cr0;
+}
+
+static inline void
+cr0_write(uint32_t cr0)
+{
+        asm volatile ("movl %0, %%cr0" : : "r"(cr0) : "memory");
+}
+
+static inline void
+fpu_clts(void)
+{
+        asm volatile ("clts" : : : "memory");
+}
+
+static inline void
+fpu_stts(void)
+{
+        cr0_write(cr0_read() | CR0_TS);
+}
+
+static inline int
+fpu_live(void)
+{
+        return !(cr0_read() & CR0_TS);
+}
+
+static inline void
+fpu_save(void *area)
+{
+        asm volatile ("fxsave (%0)" : : "r"(area) : "memory");
+}
+
+static inline void
+fpu_restore(void *area)
+{
+        asm volatile ("fxrstor (%0)" : : "r"(area) : "memory");
+}
+
+/* every cpu has to enable fxsave and sse itself */
+void
+fpu_cpu_init(void)
+{
+        if (!fpu_enabled)
+                return;
+
+        uint32_t cr0 = cr0_read();
+        cr0 &= ~CR0_EM;
+        cr0 |= CR0_MP | CR0_NE;
+        cr0_write(cr0);
+
+        uint32_t cr4;
+        asm volatile ("movl %%cr4, %0" : "=r"(cr4));
+        cr4 |= CR4_OSFXSR | CR4_OSXMMEXCPT;
+        asm volatile ("movl %0, %%cr4" : : "r"(cr4));
+
+        asm volatile ("fninit");
+        cpu_current()->fpu_owner = NULL;
+        fpu_stts();
+}
+
+/* called with interrupts disabled before the switch */
+void
+fpu_switch(task_info_t *prev)
+{
+        if (!fpu_enabled || !prev->fpu_state || !fpu_live())
+                return;
+
+        fpu_save(FPU_AREA(prev));
+        fpu_stts();
+}
+
+/* #NM, the current task used the fpu for the first time in its time
+   slice, it runs with interrupts disabled so the task can't move */
+void
+fpu_trap_handler(void)
+{
+        task_info_t *task = current_task;
+
+        if (!fpu_enabled) {
+                printf("[FPU] task %d used the fpu, but it isn't enabled\n", task->pid);
+                abort();
+        }
+
+        if (!task->fpu_state) {
+                task->fpu_state = kmem_cache_alloc(fpu_cache);
+                if (!task->fpu_state) {
+                        printf("[FPU] can't allocate fpu state of task %d\n", task->pid);
+                        abort();
+                }
+
+                memcpy(FPU_AREA(task), fpu_init_state, FPU_STATE_SIZE);
+        }
+
+        cpu_t *cpu = cpu_current();
+        fpu_clts();
+
+        if (cpu->fpu_owner == task && task->fpu_cpu == cpu->id)
+                return;
+
+        fpu_restore(FPU_AREA(task));
+        cpu->fpu_owner = task;
+        task->fpu_cpu = cpu->id;
+}
+
+/* the child starts with a copy of the parent state */
+void
+fpu_fork(task_info_t *child)
+{
+        task_info_t *task = current_task;
+        if (!task->fpu_state)
+                return;
+
+        child->fpu_state = kmem_cache_alloc(fpu_cache);
+        if (!child->fpu_state)
+                return;
+
+        uint32_t flags = irq_save();
+        if (fpu_live())
+                fpu_save(FPU_AREA(task));
+        irq_restore(flags);
+
+        memcpy(FPU_AREA(child), FPU_AREA(task), FPU_STATE_SIZE);
+}
+
+void
+fpu_free(task_info_t *task)
+{
+        if (task->fpu_state)
+                kmem_cache_free(fpu_cache, task->fpu_state);
+        task->fpu_state = NULL;
+}
+
+/* the task state is saved first if it's in the registers, it's loaded
+   again by #NM the next time the task uses the fpu */
+void
+kernel_fpu_begin(void)
+{
+        if (!fpu_enabled) {
+                printf("[FPU] kernel fpu used, but it isn't enabled\n");
+                abort();
+        }
+
+        task_lock_scheduler();
+
+        uint32_t flags = irq_save();
+        task_info_t *task = current_task;
+        if (task->fpu_state && fpu_live())
+                fpu_save(FPU_AREA(task));
+
+        cpu_current()->fpu_owner = NULL;
+        fpu_clts();
+        irq_restore(flags);
+}
+
+void
+kernel_fpu_end(void)
+{
+        fpu_stts();
+        task_unlock_scheduler();
+}
+
+void
+fpu_init(void)
+{
+        kprintf("[FPU] setup STARTING\n");
+
+        uint32_t eax = 1, ebx, ecx, edx;
+        asm volatile ("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+
+        if (~edx & CPUID_EDX_FXSR || ~edx & CPUID_EDX_SSE) {
+                kprintf("[FPU] fxsave and sse aren't supported, fpu disabled\n");
+                return;
+        }
+
+        fpu_cache = kmem_cache_create("fpu", FPU_STATE_SIZE + FPU_STATE_ALIGN);
+        fpu_enabled = 1;
+        fpu_cpu_init();
+
+        fpu_clts();
+        fpu_save(fpu_init_state);
+        fpu_stts();
+
+        kprintf("[FPU] setup COMPLETE\n");
+}
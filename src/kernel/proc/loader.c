@@ -8,14 +8,11 @@
 #include <kernel/memory.h>
 #include <kernel/file.h>
 
+/* physical address of a new page directory that shares the kernel half */
 uintptr_t
 load_new_page_dir(void)
 {
-        pd_entry_t *new_dir = kmalloc(PAGE_FRAME_SIZE);
-
-        memcpy(new_dir, page_directory, PAGE_FRAME_SIZE);
-        
-        return (uintptr_t) new_dir;
+        return page_dir_create();
 }
 
 /*
@@ -4,16 +4,18 @@
 
 #include <kernel/mutex.h>
 #include <kernel/task.h>
-#include <kernel/vmm.h>
+#include <kernel/slab.h>
 
-condvar_t *condvars;
+static kmem_cache_t *semaphore_cache;
+static kmem_cache_t *mutex_cache;
 
 semaphore_t*
 semaphore_create(uint32_t max_count)
 {
-        semaphore_t *semaphore = kmalloc(sizeof(semaphore_t));
+        semaphore_t *semaphore = kmem_cache_alloc(semaphore_cache);
         if (!semaphore) return NULL;
 
+        semaphore->lock = (spinlock_t) SPINLOCK_INIT;
         semaphore->max_count = max_count;
         semaphore->current_count = 0;
         semaphore->waiting_tasks_start = NULL;
@@ -22,19 +24,21 @@ semaphore_create(uint32_t max_count)
         return semaphore;
 }
 
-semaphore_t*
-mutex_create(void)
+void
+semaphore_free(semaphore_t *semaphore)
 {
-        return semaphore_create(1);
+        kmem_cache_free(semaphore_cache, semaphore);
 }
 
+/* a waiting task gets the semaphore from the task that releases it,
+   the count doesn't change */
 void
 semaphore_acquire(semaphore_t *semaphore)
 {
-        task_lock();
+        uint32_t flags = spin_lock_irqsave(&semaphore->lock);
         if (semaphore->current_count < semaphore->max_count) {
                 ++semaphore->current_count;
-                task_unlock();
+                spin_unlock_irqrestore(&semaphore->lock, flags);
                 return;
         }
 
@@ -45,134 +49,406 @@ semaphore_acquire(semaphore_t *semaphore)
                 semaphore->waiting_tasks_end->next = current_task;
         semaphore->waiting_tasks_end = current_task;
 
-        task_block(WAITING_FOR_LOCK);
-        task_unlock();
-}
-
-void
-mutex_acquire(semaphore_t *mutex)
-{
-        semaphore_acquire(mutex);
+        current_task->state = WAITING_FOR_LOCK;
+        spin_unlock_irqrestore(&semaphore->lock, flags);
+        task_wait();
 }
 
 void
 semaphore_release(semaphore_t *semaphore)
 {
-        task_lock();
+        uint32_t flags = spin_lock_irqsave(&semaphore->lock);
         if (!semaphore->waiting_tasks_start) {
                 --semaphore->current_count;
-                task_unlock();
+                spin_unlock_irqrestore(&semaphore->lock, flags);
                 return;
         }
 
         task_info_t *task = semaphore->waiting_tasks_start;
         semaphore->waiting_tasks_start = task->next;
+        spin_unlock_irqrestore(&semaphore->lock, flags);
+
         task_unblock(task);
-        task_unlock();
+}
+
+static mutex_t*
+mutex_alloc(uint32_t flags)
+{
+        mutex_t *mutex = kmem_cache_alloc(mutex_cache);
+        if (!mutex) return NULL;
+
+        mutex->lock = (spinlock_t) SPINLOCK_INIT;
+        mutex->owner = NULL;
+        mutex->flags = flags;
+        mutex->waiting_tasks_start = NULL;
+        mutex->waiting_tasks_end = NULL;
+        mutex->pi_next = NULL;
+
+        return mutex;
+}
+
+mutex_t*
+mutex_create(void)
+{
+        return mutex_alloc(0);
+}
+
+mutex_t*
+mutex_pi_create(void)
+{
+        return mutex_alloc(MUTEX_PI);
 }
 
 void
-mutex_release(semaphore_t *mutex)
+mutex_free(mutex_t *mutex)
 {
-        semaphore_release(mutex);
+        kmem_cache_free(mutex_cache, mutex);
 }
 
-condvar_t*
-condvar_alloc(void *condition)
+/* returns NULL if the mutex has been taken, the owner otherwise */
+static inline task_info_t*
+mutex_try(mutex_t *mutex, task_info_t *task)
 {
-        condvar_t *condvar = kmalloc(sizeof(condvar_t));
-        condvar->condition = condition;
-        condvar->tasks = NULL;
-        condvar->next = NULL;
+        task_info_t *owner = NULL;
+        __atomic_compare_exchange_n(&mutex->owner, &owner, task, 0,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+        return owner;
+}
 
-        condvar->next = condvars;
-        condvars = condvar;
-        
-        return condvar;
+/* only the owner uses its list, a mutex handed over is added by the
+   task that releases it while the new owner is still waiting */
+static inline void
+mutex_pi_add(mutex_t *mutex, task_info_t *owner)
+{
+        mutex->pi_next = owner->pi_held;
+        owner->pi_held = mutex;
 }
 
 static void
-condvar_add_list(condvar_t *condvar)
+mutex_pi_remove(mutex_t *mutex, task_info_t *owner)
 {
-        task_info_t *task = condvar->tasks;
-        for (; task->next; task = task->next) {
-                if (task == current_task)
-                        return;
+        if (owner->pi_held == mutex) {
+                owner->pi_held = mutex->pi_next;
+        } else {
+                mutex_t *held = owner->pi_held;
+                for (; held->pi_next != mutex; held = held->pi_next);
+                held->pi_next = mutex->pi_next;
         }
 
-        if (task != current_task)
-                task->next = current_task;
+        mutex->pi_next = NULL;
+}
+
+/* the inherited priority is computed again from the waiters of the PI
+   mutexes the task still holds. A task that starts waiting meanwhile
+   can only lower it with task_inherit_priority, so it isn't lost */
+static void
+mutex_pi_restore(task_info_t *task)
+{
+        __atomic_store_n(&task->inherited, TASK_PRIORITIES, __ATOMIC_RELEASE);
+
+        for (mutex_t *held = task->pi_held; held; held = held->pi_next) {
+                uint32_t flags = spin_lock_irqsave(&held->lock);
+
+                for (task_info_t *waiting = held->waiting_tasks_start; waiting; waiting = waiting->next)
+                        task_inherit_priority(task, task_effective_priority(waiting));
+
+                spin_unlock_irqrestore(&held->lock, flags);
+        }
+}
+
+/* spinning is useless if the owner can't release it in the meantime */
+static inline int
+mutex_owner_running(task_info_t *owner)
+{
+        return cpu_count > 1 && owner->on_cpu && owner->state == RUNNING;
 }
 
 void
-condvar_wait(void *condition, semaphore_t *mutex)
+mutex_acquire(mutex_t *mutex)
 {
-        task_lock();
-        condvar_t *condvar = condvars;
-        for (; condvar; condvar = condvar->next) {
-                if (condvar->condition != condition)
-                        continue;
-                         
-                current_task->next = NULL;
-                if (condvar->tasks)
-                        condvar_add_list(condvar);
-                else
-                        condvar->tasks = current_task;
+        task_info_t *task = current_task;
+        task_info_t *owner;
 
-                mutex_release(mutex);
+        uint32_t spins = 0;
+        while ((owner = mutex_try(mutex, task))) {
+                if (owner == task) {
+                        printf("[MUTEX] mutex at %x already held by task %d\n", mutex, task->pid);
+                        abort();
+                }
 
-                task_block(CONDVAR);
-                
-                task_unlock();
-                mutex_acquire(mutex);
+                if (spins >= MUTEX_SPIN_COUNT || !mutex_owner_running(owner))
+                        break;
+
+                for (; mutex->owner == owner && spins < MUTEX_SPIN_COUNT; ++spins)
+                        asm volatile ("pause");
+        }
+
+        if (!owner) {
+                if (mutex->flags & MUTEX_PI)
+                        mutex_pi_add(mutex, task);
                 return;
         }
 
-        condvar = condvar_alloc(condition);
+        /* the owner has to take the lock to release the mutex, so it
+           sees the task in the waiting list */
+        uint32_t flags = spin_lock_irqsave(&mutex->lock);
+
+        owner = mutex_try(mutex, task);
+        if (!owner) {
+                spin_unlock_irqrestore(&mutex->lock, flags);
+                if (mutex->flags & MUTEX_PI)
+                        mutex_pi_add(mutex, task);
+                return;
+        }
+
+        task->next = NULL;
+        if (!mutex->waiting_tasks_start)
+                mutex->waiting_tasks_start = task;
+        else
+                mutex->waiting_tasks_end->next = task;
+        mutex->waiting_tasks_end = task;
+        task->state = WAITING_FOR_LOCK;
+
+        if (mutex->flags & MUTEX_PI)
+                task_inherit_priority(owner, task_effective_priority(task));
+
+        spin_unlock_irqrestore(&mutex->lock, flags);
+
+        /* the mutex is owned once the task is woken up */
+        task_wait();
+}
+
+void
+mutex_release(mutex_t *mutex)
+{
+        task_info_t *task = current_task;
+
+        if (mutex->owner != task) {
+                printf("[MUTEX] mutex at %x released by task %d, owner: %x\n",
+                       mutex, task->pid, mutex->owner);
+                abort();
+        }
+
+        if (mutex->flags & MUTEX_PI)
+                mutex_pi_remove(mutex, task);
+
+        uint32_t flags = spin_lock_irqsave(&mutex->lock);
+
+        task_info_t *next = mutex->waiting_tasks_start;
+        if (next)
+                mutex->waiting_tasks_start = next->next;
+
+        __atomic_store_n(&mutex->owner, next, __ATOMIC_RELEASE);
+
+        /* the new owner inherits from the tasks still waiting */
+        if (next && mutex->flags & MUTEX_PI) {
+                mutex_pi_add(mutex, next);
+                for (task_info_t *waiting = mutex->waiting_tasks_start; waiting; waiting = waiting->next)
+                        task_inherit_priority(next, task_effective_priority(waiting));
+        }
+
+        spin_unlock_irqrestore(&mutex->lock, flags);
+
+        /* the boost from this mutex is dropped, the PI mutexes it
+           still holds keep theirs */
+        if (mutex->flags & MUTEX_PI)
+                mutex_pi_restore(task);
+
+        if (next)
+                task_unblock(next);
+}
+
+void
+rwsem_init(rwsem_t *sem)
+{
+        sem->lock = (spinlock_t) SPINLOCK_INIT;
+        sem->count = 0;
+        sem->readers = NULL;
+        sem->writers_start = NULL;
+        sem->writers_end = NULL;
+}
+
+/* the task owns the lock once it's woken up, it was handed over by
+   the task that released it */
+static void
+rwsem_sleep(rwsem_t *sem, uint32_t flags)
+{
+        current_task->state = WAITING_FOR_LOCK;
+        spin_unlock_irqrestore(&sem->lock, flags);
+        task_wait();
+}
+
+void
+rwsem_down_read(rwsem_t *sem)
+{
+        uint32_t flags = spin_lock_irqsave(&sem->lock);
+
+        if (sem->count >= 0 && !sem->writers_start) {
+                ++sem->count;
+                spin_unlock_irqrestore(&sem->lock, flags);
+                return;
+        }
+
+        current_task->next = sem->readers;
+        sem->readers = current_task;
+        rwsem_sleep(sem, flags);
+}
+
+void
+rwsem_up_read(rwsem_t *sem)
+{
+        uint32_t flags = spin_lock_irqsave(&sem->lock);
+
+        if (sem->count <= 0) {
+                printf("[MUTEX] releasing rwsem not held for reading\n");
+                abort();
+        }
+
+        task_info_t *task = NULL;
+        if (!--sem->count && sem->writers_start) {
+                task = sem->writers_start;
+                sem->writers_start = task->next;
+                sem->count = -1;
+        }
+
+        spin_unlock_irqrestore(&sem->lock, flags);
+
+        if (task)
+                task_unblock(task);
+}
+
+void
+rwsem_down_write(rwsem_t *sem)
+{
+        uint32_t flags = spin_lock_irqsave(&sem->lock);
+
+        if (!sem->count) {
+                sem->count = -1;
+                spin_unlock_irqrestore(&sem->lock, flags);
+                return;
+        }
+
+        current_task->next = NULL;
+        if (!sem->writers_start)
+                sem->writers_start = current_task;
+        else
+                sem->writers_end->next = current_task;
+        sem->writers_end = current_task;
+
+        rwsem_sleep(sem, flags);
+}
+
+/* readers that queued up behind the writer go first, otherwise a
+   steady stream of writers would starve them */
+void
+rwsem_up_write(rwsem_t *sem)
+{
+        uint32_t flags = spin_lock_irqsave(&sem->lock);
+
+        if (sem->count != -1) {
+                printf("[MUTEX] releasing rwsem not held for writing\n");
+                abort();
+        }
+
+        task_info_t *task = sem->readers;
+        sem->readers = NULL;
+        sem->count = 0;
+
+        if (task) {
+                for (task_info_t *reader = task; reader; reader = reader->next)
+                        ++sem->count;
+        } else if (sem->writers_start) {
+                task = sem->writers_start;
+                sem->writers_start = task->next;
+                task->next = NULL;
+                sem->count = -1;
+        }
+
+        spin_unlock_irqrestore(&sem->lock, flags);
+
+        /* next is overwritten when the task is queued to run */
+        while (task) {
+                task_info_t *next = task->next;
+                task_unblock(task);
+                task = next;
+        }
+}
+
+void
+wait_queue_init(wait_queue_t *queue)
+{
+        queue->lock = (spinlock_t) SPINLOCK_INIT;
+        queue->head = NULL;
+        queue->tail = NULL;
+}
+
+/* the task is queued before the mutex is released, so a wake up can't
+   be missed, if it comes before the switch the task keeps running. The
+   scheduler is locked until the switch, a tick can't switch the task
+   out while it's still holding the mutex, the waker would wait for it */
+void
+wait_queue_wait(wait_queue_t *queue, mutex_t *mutex)
+{
+        task_lock_scheduler();
+        uint32_t flags = spin_lock_irqsave(&queue->lock);
+
         current_task->next = NULL;
-        condvar->tasks = current_task;
-        
+        if (queue->tail)
+                queue->tail->next = current_task;
+        else
+                queue->head = current_task;
+        queue->tail = current_task;
+        current_task->state = CONDVAR;
+
+        spin_unlock_irqrestore(&queue->lock, flags);
+
         mutex_release(mutex);
-        task_block(CONDVAR);
-        
-        task_unlock();
+        task_wait_locked();
+        task_unlock_scheduler();
+
         mutex_acquire(mutex);
 }
 
 void
-condvar_signal(void *condition)
+wait_queue_wake_one(wait_queue_t *queue)
 {
-        task_lock();
-        condvar_t *condvar = condvars;
-        for (; condvar; condvar = condvar->next) {
-                if (condvar->condition != condition)
-                        continue;
+        uint32_t flags = spin_lock_irqsave(&queue->lock);
 
-                task_info_t *task = condvar->tasks, *next;
-                for (; task; task = next) {
-                        next = task->next;
-                        task_unblock(task);
-                }
-                        
-                condvar->tasks = NULL;
-                task_unlock();
-                return;
+        task_info_t *task = queue->head;
+        if (task) {
+                queue->head = task->next;
+                if (!queue->head)
+                        queue->tail = NULL;
         }
-        task_unlock();
+
+        spin_unlock_irqrestore(&queue->lock, flags);
+
+        if (task)
+                task_unblock(task);
 }
 
 void
-condvar_free(void *condition)
+wait_queue_wake_all(wait_queue_t *queue)
 {
-        condvar_t *condvar = condvars;
-        for (; condvar; condvar = condvar->next) {
-                if (condvar->condition != condition)
-                        continue;
+        uint32_t flags = spin_lock_irqsave(&queue->lock);
 
-                kfree(condvar);
-                return;
+        task_info_t *task = queue->head;
+        queue->head = NULL;
+        queue->tail = NULL;
+
+        spin_unlock_irqrestore(&queue->lock, flags);
+
+        /* next is overwritten when the task is queued to run */
+        while (task) {
+                task_info_t *next = task->next;
+                task_unblock(task);
+                task = next;
         }
-        
-        printf("(condvar_release) there isn't such condition in condvar\n");
-        abort();
+}
+
+void
+mutex_init(void)
+{
+        semaphore_cache = kmem_cache_create("semaphore", sizeof(semaphore_t));
+        mutex_cache = kmem_cache_create("mutex", sizeof(mutex_t));
 }
@@ -5,6 +5,7 @@
 
 #include <kernel/task.h>
 #include <kernel/vmm.h>
+#include <kernel/slab.h>
 #include <kernel/page.h>
 #include <kernel/hpet.h>
 #include <kernel/isrs.h>
@@ -14,42 +15,89 @@
 #include <kernel/memory.h>
 #include <kernel/stdio_handler.h>
 #include <kernel/loader.h>
-
-/* time slice for now is a random number */
-#define TIME_SLICE              10
+#include <kernel/timer.h>
+#include <kernel/spinlock.h>
+#include <kernel/fpu.h>
+
+/* time slice of the highest priority, in timer ticks */
+#define TIME_SLICE              2
+/* lower priorities run less often, so they get longer time slices */
+#define TASK_SLICE(priority)    (TIME_SLICE * ((priority) + 1))
+#define TASK_TICK_NS            10000000
+/* every task goes back to the highest priority, so nothing starves */
+#define TASK_BOOST_PERIOD       100
+/* a task that left its cpu this recently still has its data in the cache */
+#define TASK_CACHE_HOT_NS       2000000
+/* hpet timer used to wake up the idle task, after apic_init the
+   calibration timer isn't used anymore */
+#define TASK_ONESHOT_TIMER      0
+#define TASK_ONESHOT_IRQ        1
+/* sent to a cpu that has to look at its run queue */
+#define TASK_IPI_VECTOR         0xF0
 #define INIT_FUNC_PTR(task)     (task->ebp - 2)
+#define MAIN_FUNC_PTR(task)     (task->ebp - 1)
+/* registers pushed by syscall_handler plus user stack pointer */
+#define SYSCALL_FRAME_DWORDS    8
+#define SYSCALL_FRAME_EAX       6
 
 static void task_terminate(void);
 /* kernel/arch/i386/task_switch.S */
-extern void task_switch(task_info_t *new);
+extern void task_switch(task_info_t *new, cpu_t *cpu);
 /* kernel/arch/i386/ring3.S */
-extern void enter_ring3(void);
+extern void enter_ring3(uintptr_t esp, uintptr_t eip);
+/* kernel/usr/syscall_entry.S */
+extern void syscall_fork_return(void);
+
+/* every cpu has one FIFO run queue per priority, a bit is set in bitmap
+   when the queue of that priority isn't empty. Other cpus take the lock
+   only to place a woken up task or to steal one, it's always taken
+   with interrupts disabled */
+typedef struct {
+        spinlock_t lock;
+        task_info_t *heads[TASK_PRIORITIES];
+        task_info_t *tails[TASK_PRIORITIES];
+        uint32_t bitmap;
+        volatile uint32_t queued;      /* read without the lock to balance the load */
+
+        /* only used by the cpu itself */
+        task_info_t *prev;             /* task that is being switched out */
+        uint32_t lock_counter;
+        uint32_t postpone_counter;
+        uint32_t postpone_flag;
+        uint32_t in_tick;
+        uint64_t time_slice_remaining;
+        uint32_t boost_ticks;
+        uint64_t last_count;           /* used for time keeping */
+        int tick_stopped;
+} run_queue_t;
+
+static run_queue_t run_queues[CPU_MAX];
+
+/* every cpu has its own idle task, it's never in a run queue */
+#define idle_task    (cpu_current()->idle)
 
-task_info_t *current_task = NULL;
-static task_info_t *schedule_tasks = NULL;
-static task_info_t *sleep_tasks = NULL;
 static task_info_t *terminated_tasks = NULL;
-
+static spinlock_t terminated_lock = SPINLOCK_INIT;
 static task_info_t *task_cleaner = NULL;
-static task_info_t *idle_task = NULL;
 
 static uint32_t pid_count = 1;
 
-/* used for time keeping */
-static uint64_t last_count = 0;
+static kmem_cache_t *task_cache = NULL;
 
-static uint32_t schedule_lock_counter = 0;
-static uint32_t postpone_switch_counter = 0;
-static uint32_t postpone_switch_flag = 0;
+static int tickless_enabled = 0;
 
-static uint64_t time_slice_remaining = TIME_SLICE;
+static inline run_queue_t*
+this_rq(void)
+{
+        return run_queues + cpu_current()->id;
+}
 
 static task_info_t*
 task_create_new(void (*func)(), char *name)
 {
-        task_info_t *new_task = (task_info_t*) kmalloc(sizeof(task_info_t));
+        task_info_t *new_task = kmem_cache_alloc(task_cache);
 
-        new_task->pid = pid_count++;
+        new_task->pid = __atomic_fetch_add(&pid_count, 1, __ATOMIC_RELAXED);
         new_task->ebp = kmalloc(PAGE_FRAME_SIZE);
         /* the stack starts from higher address */
         new_task->ebp += PAGE_LAST_DWORD;
@@ -59,7 +107,7 @@ task_create_new(void (*func)(), char *name)
         *(stack) = (uintptr_t) task_terminate;
         *(--stack) = (uintptr_t) func; /* return pointer */
 
-        /* a user task and kernel task has different init function, 
+        /* a user task and kernel task has different init function,
            so temporary the init function is NULL */
         *(--stack) = (uintptr_t) NULL;
 
@@ -68,49 +116,94 @@ task_create_new(void (*func)(), char *name)
         *(--stack) = 0;     /* esi */
         *(--stack) = 0;     /* edi */
 
-        new_task->esp = (uintptr_t) stack; 
-
-        new_task->esp0 = (uintptr_t) kmalloc(PAGE_FRAME_SIZE);
-        new_task->esp0 += PAGE_LAST_DWORD;
-
-        /* TODO: create copy of page_dir */
-        new_task->page_dir = (uintptr_t) NULL;
+        new_task->esp = (uintptr_t) stack;
+
+        /* kernel stack used by interrupts and syscalls from ring 3 */
+        new_task->esp0 = (uintptr_t) kmalloc(PAGE_FRAME_SIZE) + PAGE_FRAME_SIZE;
+
+        new_task->page_dir = kernel_page_dir;
+        new_task->kernel_version = 0;
+        new_task->priority = 0;
+        new_task->slice_start = 0;
+        new_task->cpu = cpu_current()->id;
+        new_task->last_run = 0;
+        new_task->on_cpu = 0;
+        new_task->inherited = TASK_PRIORITIES;
+        new_task->pi_held = NULL;
+        new_task->fpu_state = NULL;
+        new_task->fpu_cpu = FPU_NO_CPU;
         new_task->state = AVAILABLE;
         new_task->time_used = 0;
         new_task->wake_up_time = 0;
         new_task->current_dir = NULL;
         new_task->next = NULL;
+        memset(new_task->open_files, 0, sizeof(new_task->open_files));
         memcpy(&new_task->name, name, 8);
-        
+
         return new_task;
 }
 
+/* interrupts are disabled while the counter is changed, the task
+   can't move to another cpu in between */
 void
 task_lock_scheduler(void)
 {
-        ++schedule_lock_counter;
-        
-        DPRINTF("[TASK] schedule locked: %x\n", schedule_lock_counter);
+        uint32_t flags = irq_save();
+        run_queue_t *rq = this_rq();
+        ++rq->lock_counter;
+        irq_restore(flags);
+
+        DPRINTF("[TASK] schedule locked: %x\n", rq->lock_counter);
 }
 
 void
 task_unlock_scheduler(void)
 {
-        if (!schedule_lock_counter--) {
+        uint32_t flags = irq_save();
+        run_queue_t *rq = this_rq();
+
+        if (!rq->lock_counter--) {
                 printf("[TASK] unlocking nothing\n");
                 abort();
         }
-        
-        DPRINTF("[TASK] schedule unlocked: %x\n", schedule_lock_counter);
+        irq_restore(flags);
+
+        DPRINTF("[TASK] schedule unlocked: %x\n", rq->lock_counter);
 }
 
+/* the previous task can run on other cpus only once its stack isn't
+   used anymore, it's called on the stack of the next task before
+   interrupts are enabled again */
 static void
-task_user_init(void)
+task_switch_finish(void)
 {
+        task_info_t *prev = this_rq()->prev;
+
+        prev->last_run = hpet_get_ns();
+        __atomic_store_n(&prev->on_cpu, 0, __ATOMIC_RELEASE);
+}
+
+/* first code run by a new task, task_switch returns here */
+static void
+task_start(void)
+{
+        task_switch_finish();
         task_unlock_scheduler();
-        enter_ring3();
+        STI();
+}
+
+/* the user stack is in the user half of the address space of the task,
+   its pages are mapped by the page fault handler when they are touched */
+static void
+task_user_init(void)
+{
+        task_start();
+
+        uint32_t *stack = (uint32_t*) USER_STACK_TOP;
+        *(--stack) = (uintptr_t) task_terminate;
 
         /* task then will enter into the main function */
+        enter_ring3((uintptr_t) stack, *MAIN_FUNC_PTR(current_task));
 }
 
 /* TODO: executable loader */
@@ -121,13 +214,16 @@ task_user_create_new(void (*func)(), char *name)
 
         task->open_files[0] = stdin_read;
         task->open_files[1] = stdout_write;
-        
+
         uint32_t *init_function = INIT_FUNC_PTR(task);
         *init_function = (uintptr_t) task_user_init;
 
-        task->page_dir = page_get_phys_addr(page_directory, (uintptr_t)page_directory);
-        /* havent create it yet */
-        // task->page_dir = load_new_page_dir();
+        task->page_dir = load_new_page_dir();
+        if (!task->page_dir) {
+                printf("[TASK] can't create page directory of task %d\n", task->pid);
+                abort();
+        }
+
         DPRINTF("user task %d created\n", task->pid);
         return task;
 }
@@ -135,8 +231,8 @@ task_user_create_new(void (*func)(), char *name)
 static void
 task_kernel_init(void)
 {
-        task_unlock_scheduler();
-}    
+        task_start();
+}
 
 task_info_t*
 task_kernel_create_new(void (*func)(), char *name)
@@ -145,133 +241,522 @@ task_kernel_create_new(void (*func)(), char *name)
 
         uint32_t *init_function = INIT_FUNC_PTR(task);
         *init_function = (uintptr_t) task_kernel_init;
-        
-        task->page_dir = page_get_phys_addr(page_directory, (uintptr_t)page_directory);
+
         DPRINTF("kernel task %d created\n", task->pid);
         return task;
 }
 
+/* the queue functions are called with the lock of the queue held */
+static void
+rq_enqueue(run_queue_t *rq, task_info_t *task, int front)
+{
+        uint32_t priority = task_effective_priority(task);
+        task->rq_priority = priority;
+
+        if (!rq->heads[priority]) {
+                task->next = NULL;
+                rq->heads[priority] = rq->tails[priority] = task;
+        } else if (front) {
+                task->next = rq->heads[priority];
+                rq->heads[priority] = task;
+        } else {
+                task->next = NULL;
+                rq->tails[priority]->next = task;
+                rq->tails[priority] = task;
+        }
+
+        rq->bitmap |= 1 << priority;
+        ++rq->queued;
+}
+
+/* before is the task that comes before in the queue, NULL for the head */
+static void
+rq_remove(run_queue_t *rq, task_info_t *task, task_info_t *before)
+{
+        uint32_t priority = task->rq_priority;
+
+        if (before)
+                before->next = task->next;
+        else
+                rq->heads[priority] = task->next;
+
+        if (rq->tails[priority] == task)
+                rq->tails[priority] = before;
+
+        if (!rq->heads[priority])
+                rq->bitmap &= ~(1 << priority);
+
+        task->next = NULL;
+        --rq->queued;
+}
+
+/* first task of the highest priority queue that isn't empty */
+static task_info_t*
+rq_dequeue(run_queue_t *rq)
+{
+        if (!rq->bitmap)
+                return NULL;
+
+        task_info_t *task = rq->heads[__builtin_ctz(rq->bitmap)];
+        rq_remove(rq, task, NULL);
+
+        return task;
+}
+
+static inline int
+task_cache_hot(task_info_t *task, uint64_t now)
+{
+        return now - task->last_run < TASK_CACHE_HOT_NS;
+}
+
+/* a task of the highest priority that isn't switching out of its cpu,
+   cache cold tasks are preferred because moving them costs less */
+static task_info_t*
+rq_steal(run_queue_t *rq, uint64_t now)
+{
+        for (uint32_t priority = 0; priority < TASK_PRIORITIES; ++priority) {
+                task_info_t *task = NULL, *before = NULL;
+                task_info_t *prev = NULL;
+
+                for (task_info_t *node = rq->heads[priority]; node; prev = node, node = node->next) {
+                        if (node->on_cpu)
+                                continue;
+
+                        if (!task || (task_cache_hot(task, now) && !task_cache_hot(node, now))) {
+                                task = node;
+                                before = prev;
+                        }
+                }
+
+                if (task) {
+                        rq_remove(rq, task, before);
+                        return task;
+                }
+        }
+
+        return NULL;
+}
+
+/* the local queues are empty, a task is taken from the cpu
+   with most tasks waiting */
+static task_info_t*
+task_steal(run_queue_t *rq)
+{
+        run_queue_t *busiest = NULL;
+        for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+                run_queue_t *other = run_queues + cpu;
+                if (other != rq && other->queued &&
+                    (!busiest || other->queued > busiest->queued))
+                        busiest = other;
+        }
+
+        if (!busiest)
+                return NULL;
+
+        uint64_t now = hpet_get_ns();
+        uint32_t flags = spin_lock_irqsave(&busiest->lock);
+        task_info_t *task = rq_steal(busiest, now);
+        spin_unlock_irqrestore(&busiest->lock, flags);
+
+        if (task) {
+                DPRINTF("[TASK] task %d stolen by cpu %d\n", task->pid, cpu_current()->id);
+        }
+
+        return task;
+}
+
+/* tasks that want the cpu, queued or running */
+static inline uint32_t
+task_cpu_load(uint32_t cpu)
+{
+        return run_queues[cpu].queued + (cpus[cpu].task != cpus[cpu].idle);
+}
+
+/* a task that ran recently goes back to its cpu, otherwise
+   it goes to the cpu with the lowest load */
+static uint32_t
+task_select_cpu(task_info_t *task)
+{
+        uint32_t best = task->cpu;
+
+        if (!cpus[best].started)
+                best = cpu_current()->id;
+        else if (task_cache_hot(task, hpet_get_ns()))
+                return best;
+
+        for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+                if (cpus[cpu].started && task_cpu_load(cpu) < task_cpu_load(best))
+                        best = cpu;
+
+        return best;
+}
+
+void
+task_wake_cpu(uint32_t cpu)
+{
+        if (cpu != cpu_current()->id)
+                lapic_send_ipi(cpus[cpu].apic_id, LAPIC_ICR_FIXED | TASK_IPI_VECTOR);
+}
+
+/* the cpu is woken up if the task can run there now, otherwise
+   an idle cpu is woken up so it can steal the task */
+static void
+task_kick(uint32_t cpu, task_info_t *task)
+{
+        task_info_t *running = cpus[cpu].task;
+
+        if (running != cpus[cpu].idle &&
+            task_effective_priority(task) >= task_effective_priority(running)) {
+                for (cpu = 0; cpu < cpu_count; ++cpu)
+                        if (cpus[cpu].started && cpus[cpu].task == cpus[cpu].idle)
+                                break;
+
+                if (cpu == cpu_count)
+                        return;
+        }
+
+        task_wake_cpu(cpu);
+}
+
+/* returns the cpu where the task has been queued */
+static uint32_t
+task_place(task_info_t *task, int front)
+{
+        uint32_t cpu = task_select_cpu(task);
+        run_queue_t *rq = run_queues + cpu;
+
+        uint32_t flags = spin_lock_irqsave(&rq->lock);
+        rq_enqueue(rq, task, front);
+        spin_unlock_irqrestore(&rq->lock, flags);
+
+        DPRINTF("[TASK] task %d added to run queue %d of cpu %d\n",
+                task->pid, task->rq_priority, cpu);
+
+        task_kick(cpu, task);
+        return cpu;
+}
+
+/* the queue of a queued task only changes with the lock of its queue
+   held, a task that isn't queued gets the inherited priority when it's
+   queued again. Only the inherited priority changes, its own priority
+   is used again once the mutexes are released */
+void
+task_inherit_priority(task_info_t *task, uint32_t priority)
+{
+        uint32_t inherited = task->inherited;
+        do {
+                if (inherited <= priority)
+                        return;
+        } while (!__atomic_compare_exchange_n(&task->inherited, &inherited, priority, 0,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        uint32_t flags = irq_save();
+
+        for (uint32_t cpu = 0; cpu < cpu_count; ++cpu) {
+                run_queue_t *rq = run_queues + cpu;
+                spin_lock(&rq->lock);
+
+                task_info_t *before = NULL;
+                task_info_t *node = rq->heads[task->rq_priority];
+                for (; node && node != task; before = node, node = node->next);
+
+                if (node) {
+                        rq_remove(rq, task, before);
+                        rq_enqueue(rq, task, 0);
+                        spin_unlock(&rq->lock);
+
+                        DPRINTF("[TASK] task %d inherited priority %d\n",
+                                task->pid, task->rq_priority);
+                        task_kick(cpu, task);
+                        break;
+                }
+
+                spin_unlock(&rq->lock);
+        }
+
+        irq_restore(flags);
+}
+
+/* the idle task is never in a run queue, it runs only
+   when every queue is empty */
 void
 task_add_node(task_info_t *task)
 {
         task->state = AVAILABLE;
 
-        /* adds quickly but the first task in list might never get time */
-        task->next = schedule_tasks;
-        schedule_tasks = task;
-      
-        DPRINTF("[TASK] task %d added to schedule list\n", task->pid);
-        //task_print_list(schedule_tasks);
+        if (task == idle_task)
+                return;
+
+        task_lock_scheduler();
+        task_place(task, 0);
+        task_unlock_scheduler();
 }
 
-static void
-task_switch_wrapper(task_info_t *task)
+/* only one waker moves a blocked task to AVAILABLE, a task woken up
+   before it switched out keeps running. Returns 1 if the task has
+   to be queued */
+static int
+task_wake_state(task_info_t *task)
 {
-        if (postpone_switch_counter) {
-                DPRINTF("[TASK] switch not happening to task %d\n", task->pid);
-                DPRINTF("[TASK] postpone flag UP\n");
-                postpone_switch_flag = 1;
+        if (task == current_task) {
+                if (task->state != AVAILABLE)
+                        task->state = RUNNING;
+                return 0;
+        }
 
-                /* add task to list so the postponed switch is possible */
-                task_add_node(task);
+        uint32_t state = task->state;
+        do {
+                if (state == AVAILABLE || state == RUNNING)
+                        return 0;
+        } while (!__atomic_compare_exchange_n(&task->state, &state, AVAILABLE, 0,
+                                              __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+        /* its stack can still be in use by the cpu it's leaving */
+        while (task->on_cpu && task->cpu != cpu_current()->id)
+                asm volatile ("pause");
+
+        return 1;
+}
+
+/* only the idle task is runnable, the periodic tick is stopped and
+   the hpet fires once when the first timer expires, timers only run
+   on the BSP so the other cpus don't need it */
+static void
+task_tick_stop(run_queue_t *rq)
+{
+        if (!tickless_enabled || rq->tick_stopped)
                 return;
+
+        uint64_t next = cpu_current()->id ? 0 : timer_next();
+        if (next) {
+                hpet_set_deadline(TASK_ONESHOT_TIMER, next);
+
+                /* the counter already passed the deadline, the one shot
+                   wouldn't fire, so the tick keeps running */
+                if (hpet_get_ns() >= next)
+                        return;
         }
 
-        if (current_task == idle_task)
-                task_add_node(current_task);
-                       
-        /* there isn't any need to schedule if the only task is the idle task */
-        time_slice_remaining = (task == idle_task) ? 0 : TIME_SLICE;
+        DPRINTF("[TASK] periodic tick stopped\n");
+        lapic_timer_stop();
+        rq->tick_stopped = 1;
+}
 
-        DPRINTF("new time slice: %x\n", time_slice_remaining);
-        DPRINTF("[TASK] switching to task %d\n", task->pid);
+static void
+task_tick_restart(run_queue_t *rq)
+{
+        if (!rq->tick_stopped)
+                return;
 
-        task_switch(task);
+        DPRINTF("[TASK] periodic tick restarted\n");
+        lapic_timer_start();
+        rq->tick_stopped = 0;
 }
 
-void
-task_force_switch(task_info_t *task)
+/* called with interrupts disabled */
+static void
+task_switch_wrapper(run_queue_t *rq, task_info_t *task)
 {
-        task_lock_scheduler();
-        current_task->next = schedule_tasks;
-        schedule_tasks = current_task;
+        /* there isn't any need to schedule if the only task is the idle task */
+        rq->time_slice_remaining = (task == idle_task) ? 0 : TASK_SLICE(task->priority);
+        task->slice_start = task->time_used;
 
-        task_switch_wrapper(task);
-        task_unlock_scheduler();
+        if (task == idle_task)
+                task_tick_stop(rq);
+        else
+                task_tick_restart(rq);
+
+        DPRINTF("new time slice: %x\n", rq->time_slice_remaining);
+        DPRINTF("[TASK] switching to task %d\n", task->pid);
+
+        rq->prev = current_task;
+        task->cpu = cpu_current()->id;
+        task->on_cpu = 1;
+
+        fpu_switch(rq->prev);
+
+        task->kernel_version = page_dir_sync(task->page_dir, task->kernel_version);
+        task_switch(task, cpu_current());
+        task_switch_finish();
 }
 
 static void
-task_update_counter(void)
+task_update_counter(run_queue_t *rq)
 {
         uint64_t current_count = hpet_read_counter();
-        uint64_t elapsed_time = (current_count - last_count) * 10;
-        last_count = current_count;
-        
+        uint64_t elapsed_time = (current_count - rq->last_count) * 10;
+        rq->last_count = current_count;
+
         current_task->time_used += elapsed_time;
 }
 
-// TODO: introduce UNIX scheduler instead of awful round robin
+/* a task that used its whole time slice is a cpu hog and it
+   is moved down, a task that blocked before is interactive and it
+   is moved up */
 static void
-task_schedule(void)
+task_update_priority(task_info_t *task)
+{
+        uint64_t used = task->time_used - task->slice_start;
+        uint64_t slice = (uint64_t)TASK_SLICE(task->priority) * TASK_TICK_NS;
+
+        if (used >= slice) {
+                if (task->priority < TASK_PRIORITIES - 1)
+                        ++task->priority;
+        } else if (task->state != RUNNING && task->priority) {
+                --task->priority;
+        }
+}
+
+/* every task queued on this cpu is moved to the highest priority */
+static void
+task_boost(run_queue_t *rq)
 {
-        task_update_counter();
+        uint32_t flags = spin_lock_irqsave(&rq->lock);
 
-        if (postpone_switch_counter) {
-                postpone_switch_flag = 1;
-                return;
+        for (uint32_t priority = 1; priority < TASK_PRIORITIES; ++priority) {
+                task_info_t *task = rq->heads[priority];
+                if (!task)
+                        continue;
+
+                for (; task; task = task->next)
+                        task->priority = task->rq_priority = 0;
+
+                if (rq->heads[0])
+                        rq->tails[0]->next = rq->heads[priority];
+                else
+                        rq->heads[0] = rq->heads[priority];
+
+                rq->tails[0] = rq->tails[priority];
+                rq->heads[priority] = rq->tails[priority] = NULL;
         }
 
-        if (!schedule_tasks) {
-                DPRINTF("[TASK] no task ready to switch to\n");
+        if (rq->bitmap)
+                rq->bitmap = 1;
+
+        spin_unlock_irqrestore(&rq->lock, flags);
+        current_task->priority = 0;
+}
+
+/* interrupts stay disabled from the choice of the next task until
+   the switch, a wake up on this cpu can't happen in between */
+static void
+task_schedule(void)
+{
+        uint32_t flags = irq_save();
+        run_queue_t *rq = this_rq();
+        task_info_t *prev = current_task;
+
+        task_update_counter(rq);
+
+        /* the switch happens when task_unlock is called, at the
+           end of the tick, or at the next tick if the scheduler is locked
+           by someone else than the caller */
+        if (rq->postpone_counter || rq->in_tick || rq->lock_counter > 1) {
+                rq->postpone_flag = 1;
+                irq_restore(flags);
                 return;
         }
 
-        task_print_list(schedule_tasks);
-        
-        task_info_t *task = schedule_tasks;
-        schedule_tasks = task->next;
-        DPRINTF("[TASK] ready to switch to task %d\n", task->pid);
+        spin_lock(&rq->lock);
 
-        /* it doesn't want to immediately switch to idle task, first check if
-           there are other possibilities */
-        if (task == idle_task) {
-                /* 1. check if there are other task on the scheduled list */
-                if (schedule_tasks) {
-                        task = schedule_tasks;
-                        idle_task->next = task->next;
-                        schedule_tasks = idle_task;
-                        DPRINTF("[TASK] instead of idle, there is task %d\n", task->pid);
-
-                /* 2. check if current task can still run and it wasn't blocked */
-                } else if (current_task->state == RUNNING) {
-                        DPRINTF("[TASK] instead of idle, continuing running "
-                                "current task %d\n", current_task->pid);
-                        return;
+        if (prev != idle_task) {
+                task_update_priority(prev);
 
+                /* preempted task goes back to the end of its queue */
+                if (prev->state == RUNNING) {
+                        prev->state = AVAILABLE;
+                        rq_enqueue(rq, prev, 0);
                 }
         }
 
-        DPRINTF("[TASK] current task state: %x\n", current_task->state);
+        DPRINTF("[TASK] run queues: %x\n", rq->bitmap);
+
+        task_info_t *task = rq_dequeue(rq);
+        spin_unlock(&rq->lock);
+
+        if (!task)
+                task = task_steal(rq);
+
+        if (!task) {
+                /* current task is idle and it can keep running */
+                if (prev->state == RUNNING) {
+                        DPRINTF("[TASK] no task ready to switch to\n");
+                        irq_restore(flags);
+                        return;
+                }
+
+                task = idle_task;
+        }
+
+        /* the current task is still the one with the highest priority */
+        if (task == prev) {
+                DPRINTF("[TASK] continuing running current task %d\n", task->pid);
+                task->state = RUNNING;
+                rq->time_slice_remaining = TASK_SLICE(task->priority);
+                task->slice_start = task->time_used;
+                irq_restore(flags);
+                return;
+        }
+
+        DPRINTF("[TASK] ready to switch to task %d\n", task->pid);
+        DPRINTF("[TASK] current task state: %x\n", prev->state);
         DPRINTF("[TASK] switch called by scheduling\n");
-        task_switch_wrapper(task);
+        task_switch_wrapper(rq, task);
+        irq_restore(flags);
 }
 
+/* used by interrupt handlers to wake up interactive tasks, the task
+   gets the highest priority and it's put first on this cpu */
 void
-task_lock(void)
+task_force_switch(task_info_t *task)
 {
         task_lock_scheduler();
-        ++postpone_switch_counter;
+
+        if (task_wake_state(task)) {
+                run_queue_t *rq = this_rq();
+                task->priority = 0;
+
+                uint32_t flags = spin_lock_irqsave(&rq->lock);
+                rq_enqueue(rq, task, 1);
+                spin_unlock_irqrestore(&rq->lock, flags);
+
+                task_schedule();
+        }
+
+        task_unlock_scheduler();
+}
+
+/* the current task can't be switched out until task_unlock, it only
+   keeps it on this cpu, shared data has to be protected by its own lock */
+void
+task_lock(void)
+{
+        uint32_t flags = irq_save();
+        run_queue_t *rq = this_rq();
+
+        ++rq->lock_counter;
+        ++rq->postpone_counter;
+
+        irq_restore(flags);
 }
 
 void
 task_unlock(void)
 {
+        uint32_t flags = irq_save();
+        run_queue_t *rq = this_rq();
+        uint32_t postponed = 0;
+
         /* if postpone flag isn't set, it means there isn't any task
-           switch that was postponed, so it simply decrease postpone counter */
-        if (!--postpone_switch_counter && postpone_switch_flag) {
-                postpone_switch_flag = 0;
-                task_schedule();
+           switch that was postponed */
+        if (!--rq->postpone_counter) {
+                postponed = rq->postpone_flag;
+                rq->postpone_flag = 0;
         }
+        irq_restore(flags);
+
+        if (postponed)
+                task_schedule();
 
         task_unlock_scheduler();
 }
@@ -285,27 +770,76 @@ task_block(task_state_t reason)
         task_unlock_scheduler();
 }
 
+/* the caller already set the state, if the task has been woken up
+   in the meantime the state is RUNNING again and it keeps running */
+void
+task_wait(void)
+{
+        task_lock_scheduler();
+        task_schedule();
+        task_unlock_scheduler();
+}
+
+/* same as task_wait, for a caller that locked the scheduler before
+   setting its state, it unlocks the scheduler after it's back */
+void
+task_wait_locked(void)
+{
+        task_schedule();
+}
+
 void
 task_unblock(task_info_t *task)
 {
         task_lock_scheduler();
-        
-        /* there is immediate switch if there is only one task
-           or the current task is the idle task */
-        if (!schedule_tasks || current_task == idle_task) {
-                DPRINTF("[TASK] switch called by unblock\n");
-                task_switch_wrapper(task);
-        } else
-                task_add_node(task);
-                
+
+        if (task_wake_state(task)) {
+                uint32_t cpu = task_place(task, 0);
+
+                /* current task is preempted by a higher priority task */
+                if (cpu == cpu_current()->id &&
+                    (current_task == idle_task ||
+                     task_effective_priority(task) < task_effective_priority(current_task))) {
+                        DPRINTF("[TASK] switch called by unblock\n");
+                        task_schedule();
+                }
+        }
+
         task_unlock_scheduler();
 }
 
-static void
+/* a task is waiting on this cpu or on another one that is busy */
+static int
+task_idle_has_work(run_queue_t *rq)
+{
+        if (rq->queued)
+                return 1;
+
+        for (uint32_t cpu = 0; cpu < cpu_count; ++cpu)
+                if (run_queues[cpu].queued)
+                        return 1;
+
+        return 0;
+}
+
+/* queues are checked with interrupts disabled, sti enables them only
+   after hlt so a wake up ipi can't be missed */
+void
 task_idle(void)
 {
-        for (;;) 
-                asm volatile ("hlt");
+        for (;;) {
+                asm volatile ("cli");
+                if (task_idle_has_work(this_rq())) {
+                        asm volatile ("sti");
+                        task_lock_scheduler();
+                        task_schedule();
+                        task_unlock_scheduler();
+                        continue;
+                }
+
+                asm volatile ("sti\n\t"
+                              "hlt");
+        }
 }
 
 static void
@@ -313,7 +847,12 @@ task_cleanup(task_info_t *task)
 {
         DPRINTF("[TASK] cleaning up task %d\n", task->pid);
         kfree(task->ebp - PAGE_LAST_DWORD);
-        kfree(task);
+        kfree((void*)(task->esp0 - PAGE_FRAME_SIZE));
+
+        if (task->page_dir != kernel_page_dir)
+                page_dir_destroy(task->page_dir);
+        fpu_free(task);
+        kmem_cache_free(task_cache, task);
 }
 
 static void
@@ -322,19 +861,27 @@ task_clean(void)
         /* if there wasn't a infinite loop, the task would terminated
            and try to clean itself up, crashing the OS probably */
         for (;;) {
-                task_lock();
+                uint32_t flags = spin_lock_irqsave(&terminated_lock);
+                task_info_t *task = terminated_tasks;
 
-                while (terminated_tasks) {
-                        task_info_t *task = terminated_tasks;
-                        terminated_tasks = task->next;
-                        task_cleanup(task);
+                /* finished cleaning, it get blocked immediately and switch
+                   to other tasks, the state is set with the list locked
+                   so a task terminated in the meantime wakes it up */
+                if (!task) {
+                        current_task->state = BLOCKED;
+                        spin_unlock_irqrestore(&terminated_lock, flags);
+                        task_wait();
+                        continue;
                 }
-                
-                task_unlock();
 
-                /* finished cleaning, it get blocked immediately and switch
-                   to other tasks */
-                task_block(BLOCKED);
+                terminated_tasks = task->next;
+                spin_unlock_irqrestore(&terminated_lock, flags);
+
+                /* another cpu can still be switching out of it */
+                while (task->on_cpu)
+                        asm volatile ("pause");
+
+                task_cleanup(task);
         }
 }
 
@@ -345,9 +892,11 @@ task_terminate(void)
 
         /* when a task get terminated it is simply blocked with TERMINATED
            state, then put on a list */
+        uint32_t flags = spin_lock_irqsave(&terminated_lock);
         current_task->next = terminated_tasks;
         terminated_tasks = current_task;
- 
+        spin_unlock_irqrestore(&terminated_lock, flags);
+
         DPRINTF("[TASK] task %d has been terminated\n", current_task->pid);
         task_block(TERMINATED);
 
@@ -357,107 +906,260 @@ task_terminate(void)
         task_unlock();
 }
 
+static void
+task_fork_init(void)
+{
+        task_start();
+}
+
+/* the child gets a copy on write copy of the user half, and it starts
+   returning from the same syscall with 0 as return value */
+int
+task_fork(void)
+{
+        task_info_t *child = task_create_new(NULL, current_task->name);
+        child->priority = current_task->priority;
+        fpu_fork(child);
+
+        /* the child keeps the kernel directory until it has its own */
+        uintptr_t page_dir = page_dir_fork();
+        if (!page_dir) {
+                task_cleanup(child);
+                return -1;
+        }
+        child->page_dir = page_dir;
+
+        /* frame that syscall_handler pushed at the top of the kernel stack */
+        uint32_t *frame = (uint32_t*) current_task->esp0 - SYSCALL_FRAME_DWORDS;
+        uint32_t *stack = (uint32_t*) child->esp0 - SYSCALL_FRAME_DWORDS;
+        memcpy(stack, frame, SYSCALL_FRAME_DWORDS * sizeof(uint32_t));
+        stack[SYSCALL_FRAME_EAX] = 0;
+
+        /* same layout of task_create_new, task_switch returns into
+           task_fork_init and then into the syscall exit path */
+        *(--stack) = (uintptr_t) syscall_fork_return;
+        *(--stack) = (uintptr_t) task_fork_init;
+        *(--stack) = 0;     /* ebp */
+        *(--stack) = 0;     /* ebx */
+        *(--stack) = 0;     /* esi */
+        *(--stack) = 0;     /* edi */
+        child->esp = (uintptr_t) stack;
+
+        for (int i = 0; i < OPEN_FILES_COUNT; ++i)
+                if (current_task->open_files[i])
+                        child->open_files[i] = file_dup(current_task->open_files[i]);
+
+        if (current_task->current_dir)
+                child->current_dir = dir_dup(current_task->current_dir);
+
+        task_add_node(child);
+
+        DPRINTF("[TASK] task %d forked into task %d\n", current_task->pid, child->pid);
+        return child->pid;
+}
+
+static void
+task_wake_up(void *data)
+{
+        task_info_t *task = data;
+
+        DPRINTF("[TASK] task %d has been woken up\n", task->pid);
+        task_unblock(task);
+}
+
 void
 nano_sleep_until(uint64_t wake_up_time_ns)
 {
-        task_lock();
+        /* the timer is on the stack of the task, it stays valid
+           because the task doesn't run until the timer expires */
+        timer_t timer;
+
+        task_lock_scheduler();
 
         /* if sleep is so small that wake up time already passed, return
            instead of wasting time */
         if (wake_up_time_ns < hpet_get_ns()) {
-                task_unlock();
+                task_unlock_scheduler();
                 return;
         }
 
+        /* the state is set first, the timer can expire on the BSP
+           before this task switched out */
         current_task->wake_up_time = wake_up_time_ns;
+        current_task->state = SLEEPING;
 
-        DPRINTF("[TASK] task %d has been put to sleep\n", current_task->pid);
+        timer_add(&timer, wake_up_time_ns, task_wake_up, current_task);
 
-        current_task->next = sleep_tasks;
-        sleep_tasks = current_task;
+        DPRINTF("[TASK] task %d has been put to sleep\n", current_task->pid);
 
-        task_unlock();
-        task_block(SLEEPING);       
+        /* same as task_block, the lock can't be taken twice because the
+           task switch happens while it's held */
+        task_schedule();
+        task_unlock_scheduler();
 }
 
-
-__attribute__ ((interrupt))
-void
-task_time_handler(interrupt_frame_t *frame)
+static void
+task_tick(void)
 {
-        (void) frame; /* suppress compiler warning */
-        
+        run_queue_t *rq = this_rq();
+
         /* if locked, send EOI and return */
-        if (schedule_lock_counter) {
-                DPRINTF("[TASK] schedule blocked: %d\n", schedule_lock_counter);
+        if (rq->lock_counter) {
+                DPRINTF("[TASK] schedule blocked: %d\n", rq->lock_counter);
+
+                /* a one shot that can't be handled now would be lost */
+                task_tick_restart(rq);
                 lapic_sendEOI();
                 return;
         }
-        
-        task_lock();
 
-        task_info_t *next_task = sleep_tasks;
-        sleep_tasks = NULL;
-        uint64_t actual_time = hpet_get_ns();
+        task_lock_scheduler();
 
-        /* for debug, it doesn't have any function */
-        if (next_task) {
-                DPRINTF("[TASK] sleep list: ");
-                task_print_list(sleep_tasks);
-        }
+        /* sleeping tasks are woken up by their timers on the BSP,
+           switches wait for the EOI */
+        rq->in_tick = 1;
+        if (!cpu_current()->id)
+                timer_run();
 
-        /* checking if any task can be woken up */
-        while (next_task) {
-                task_info_t *task = next_task;
-                next_task = task->next;
-
-                if (task->wake_up_time <= actual_time) {
-                        DPRINTF("[TASK] task %d has been woken up\n", task->pid);
-                        task_unblock(task);
-                } else {
-                        DPRINTF("[TASK] task %d can't be woken up yet\n", task->pid);
-                        task->next = sleep_tasks;
-                        sleep_tasks = task;
-                }
+        if (++rq->boost_ticks == TASK_BOOST_PERIOD) {
+                rq->boost_ticks = 0;
+                task_boost(rq);
         }
-        
-        /* if time slice remaining = 0 then it means there's no need to 
-           do any scheduling because there's only one task (current one or idle) */
-        if (time_slice_remaining && !--time_slice_remaining) {
-                lapic_sendEOI();
+        rq->in_tick = 0;
+
+        /* if time slice remaining = 0 then it means the idle task is running,
+           it's left as soon as a task is ready */
+        int schedule = rq->postpone_flag ||
+                (rq->time_slice_remaining && !--rq->time_slice_remaining) ||
+                (current_task == idle_task && task_idle_has_work(rq));
+        rq->postpone_flag = 0;
+
+        lapic_sendEOI();
+
+        if (schedule)
                 task_schedule();
-        }
+        else if (current_task == idle_task)
+                task_tick_stop(rq);
+
+        task_unlock_scheduler();
+}
+
+__attribute__ ((interrupt))
+void
+task_time_handler(interrupt_frame_t *frame)
+{
+        (void) frame; /* suppress compiler warning */
+        task_tick();
+}
+
+/* the one shot can also fire after the tick has been restarted,
+   then it's only an extra tick */
+__attribute__ ((interrupt))
+static void
+task_oneshot_handler(interrupt_frame_t *frame)
+{
+        (void) frame;
+        hpet_timer_ack(TASK_ONESHOT_TIMER);
+        task_tick();
+}
+
+/* another cpu queued a task here or wants this cpu to steal one,
+   the tick is restarted and stopped again at the next tick if
+   there's still nothing to do */
+__attribute__ ((interrupt))
+static void
+task_ipi_handler(interrupt_frame_t *frame)
+{
+        (void) frame;
+        run_queue_t *rq = this_rq();
 
+        task_tick_restart(rq);
         lapic_sendEOI();
-        task_unlock();
+
+        /* the idle loop and the tick look at the queues anyway */
+        if (rq->lock_counter)
+                return;
+
+        task_lock_scheduler();
+        task_schedule();
+        task_unlock_scheduler();
+}
+
+/* the periodic tick can be stopped only after the lapic timer
+   has been calibrated, it's called after apic_init */
+void
+task_tickless_init(void)
+{
+        kprintf("[TASK] tickless idle setup STARTING\n");
+
+        hpet_timer_ack(TASK_ONESHOT_TIMER);
+        hpet_create_timer(TASK_ONESHOT_TIMER, TASK_ONESHOT_IRQ, task_oneshot_handler);
+        tickless_enabled = 1;
+
+        kprintf("[TASK] tickless idle setup COMPLETE\n");
+}
+
+/* task of the code that is already running on a cpu when it starts,
+   its stack is saved at the first switch */
+task_info_t*
+task_cpu_create(char *name)
+{
+        task_info_t *task = kmem_cache_alloc(task_cache);
+        task->pid = __atomic_fetch_add(&pid_count, 1, __ATOMIC_RELAXED);
+
+        task->esp = 0;
+        task->esp0 = 0;
+        task->ebp = NULL;
+
+        task->page_dir = kernel_page_dir;
+        task->kernel_version = 0;
+        task->state = RUNNING;
+        task->time_used = 0;
+        task->wake_up_time = 0;
+        task->priority = 0;
+        task->slice_start = 0;
+        task->cpu = 0;
+        task->last_run = 0;
+        task->on_cpu = 1;
+        task->inherited = TASK_PRIORITIES;
+        task->pi_held = NULL;
+        task->fpu_state = NULL;
+        task->fpu_cpu = FPU_NO_CPU;
+        task->current_dir = NULL;
+        task->next = NULL;
+        memset(task->open_files, 0, sizeof(task->open_files));
+        size_t length = strlen(name);
+        if (length >= sizeof(task->name))
+                length = sizeof(task->name) - 1;
+
+        memset(task->name, 0, sizeof(task->name));
+        memcpy(task->name, name, length);
+
+        return task;
 }
-       
+
 void
 multitask_init(void)
 {
         kprintf("[TASK] setup STARTING\n");
 
-        current_task = kmalloc(sizeof(task_info_t)); 
-        current_task->pid = pid_count++;
-
-        current_task->esp = 0;
-        current_task->esp0 = 0;
-       
-        current_task->page_dir = page_get_phys_addr(page_directory, (uintptr_t)page_directory);
-        current_task->state = RUNNING;
-        current_task->time_used = 0;
-        current_task->next = NULL;
-        memcpy(&current_task->name, "kernel", 7);
-        
+        task_cache = kmem_cache_create("task", sizeof(task_info_t));
+
+        current_task = task_cpu_create("kernel");
+
         /* task cleaner cleans up terminated tasks and free its memory when possible */
         task_cleaner = task_kernel_create_new(task_clean, "clean");
         idle_task = task_kernel_create_new(task_idle, "idle");
-        task_add_node(idle_task);
+        idle_task->priority = TASK_PRIORITIES - 1;
+        cpu_current()->started = 1;
+
+        idt_create(idt_entries + TASK_IPI_VECTOR, (uintptr_t) task_ipi_handler,
+                   IDT_PRESENT | IDT_32B_INT);
 
         kprintf("[TASK] kernel main task PID: %x\n", current_task->pid);
         kprintf("[TASK] task cleaner PID: %x\n", task_cleaner->pid);
         kprintf("[TASK] idle task PID: %x\n", idle_task->pid);
-        
+
         kprintf("[TASK] setup COMPLETE\n");
 }
 
@@ -466,11 +1168,15 @@ void
 task_print_info(void)
 {
 #ifdef DEBUG
-        kprintf("[TASK][INFO] irq_disable_counter: %x, ", schedule_lock_counter);
-        kprintf("postpone_switch_counter: %x, ", postpone_switch_counter);
-        kprintf("postpone_switch_flag: %x, ", postpone_switch_flag);
+        run_queue_t *rq = this_rq();
+
+        kprintf("[TASK][INFO] cpu: %d, ", cpu_current()->id);
+        kprintf("irq_disable_counter: %x, ", rq->lock_counter);
+        kprintf("postpone_switch_counter: %x, ", rq->postpone_counter);
+        kprintf("postpone_switch_flag: %x, ", rq->postpone_flag);
+        kprintf("queued: %d, ", rq->queued);
         kprintf("idle time: %x%x, ", idle_task->time_used);
-        kprintf("time slice remaining: %d\n", time_slice_remaining);
+        kprintf("time slice remaining: %d\n", rq->time_slice_remaining);
 #endif
 }
 
@@ -0,0 +1,179 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <kernel/timer.h>
+#include <kernel/task.h>
+#include <kernel/hpet.h>
+#include <kernel/spinlock.h>
+#include <kernel/smp.h>
+#include <kernel/debug.h>
+
+/* pairing heap ordered by expiration time, the root is always the
+   next timer that expires. The children of a timer are linked through
+   next and prev, the first child points back to its parent */
+static timer_t *timer_root = NULL;
+static spinlock_t timer_lock = SPINLOCK_INIT;
+
+/* the root with the later timer becomes the first child of the other */
+static timer_t*
+timer_meld(timer_t *a, timer_t *b)
+{
+        if (!a)
+                return b;
+        if (!b)
+                return a;
+
+        if (b->expires < a->expires) {
+                timer_t *tmp = a;
+                a = b;
+                b = tmp;
+        }
+
+        b->prev = a;
+        b->next = a->child;
+        if (a->child)
+                a->child->prev = b;
+        a->child = b;
+
+        return a;
+}
+
+/* the children are melded in pairs from the left, then the pairs are
+   melded into one heap from the right, it keeps the heap shallow */
+static timer_t*
+timer_merge_pairs(timer_t *first)
+{
+        timer_t *pairs = NULL;
+        while (first) {
+                timer_t *a = first, *b = first->next;
+                first = (b) ? b->next : NULL;
+
+                a->next = a->prev = NULL;
+                if (b)
+                        b->next = b->prev = NULL;
+
+                timer_t *pair = timer_meld(a, b);
+                pair->next = pairs;
+                pairs = pair;
+        }
+
+        timer_t *root = NULL;
+        while (pairs) {
+                timer_t *pair = pairs;
+                pairs = pair->next;
+                pair->next = NULL;
+                root = timer_meld(root, pair);
+        }
+
+        return root;
+}
+
+/* the subtree of the timer is cut off, its children become a heap
+   that is melded back with the rest */
+static void
+timer_remove(timer_t *timer)
+{
+        timer_t *children = timer_merge_pairs(timer->child);
+
+        if (timer == timer_root) {
+                timer_root = children;
+        } else {
+                if (timer->prev->child == timer)
+                        timer->prev->child = timer->next;
+                else
+                        timer->prev->next = timer->next;
+
+                if (timer->next)
+                        timer->next->prev = timer->prev;
+
+                timer_root = timer_meld(timer_root, children);
+        }
+
+        timer->child = timer->next = timer->prev = NULL;
+        timer->queued = 0;
+}
+
+/* the lock is taken with interrupts disabled, the queue is
+   also used by the timer interrupt */
+void
+timer_add(timer_t *timer, uint64_t expires, void (*func)(void*), void *data)
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+        timer->expires = expires;
+        timer->func = func;
+        timer->data = data;
+        timer->queued = 1;
+        timer->child = timer->next = timer->prev = NULL;
+        timer_root = timer_meld(timer_root, timer);
+
+        int first = timer_root == timer;
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        /* timers are run by the BSP, if its tick is stopped it
+           has to see the new deadline */
+        if (first && cpu_current()->id)
+                task_wake_cpu(0);
+
+        DPRINTF("[TIMER] timer added, expires at %x%x\n", expires);
+}
+
+/* returns -1 if the timer wasn't queued, it already expired. Its
+   callback may still be running on the BSP, a caller that frees what
+   data points to has to wait for the callback itself */
+int
+timer_cancel(timer_t *timer)
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+        if (!timer->queued) {
+                spin_unlock_irqrestore(&timer_lock, flags);
+                return -1;
+        }
+
+        timer_remove(timer);
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        return 0;
+}
+
+/* called by the timer interrupt of the BSP, if nothing expired it
+   only compares the first timer, callbacks run without the lock */
+void
+timer_run(void)
+{
+        if (!timer_root)
+                return;
+
+        uint64_t now = hpet_get_ns();
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+
+        while (timer_root && timer_root->expires <= now) {
+                timer_t *timer = timer_root;
+                timer_remove(timer);
+
+                /* once the lock is dropped the timer can be reused
+                   by its owner, it's only read with the lock held */
+                void (*func)(void*) = timer->func;
+                void *data = timer->data;
+                spin_unlock_irqrestore(&timer_lock, flags);
+
+                DPRINTF("[TIMER] timer expired\n");
+                func(data);
+
+                flags = spin_lock_irqsave(&timer_lock);
+        }
+
+        spin_unlock_irqrestore(&timer_lock, flags);
+}
+
+/* expiration time of the first timer, 0 if there isn't any */
+uint64_t
+timer_next(void)
+{
+        uint32_t flags = spin_lock_irqsave(&timer_lock);
+        uint64_t next = (timer_root) ? timer_root->expires : 0;
+        spin_unlock_irqrestore(&timer_lock, flags);
+
+        return next;
+}
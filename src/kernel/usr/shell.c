@@ -110,6 +110,50 @@ shell_cat(char *buffer)
         SYSCALL(ret, SYS_CLOSE, fd);
 }
 
+static void
+shell_print_num(char *name, uint32_t value)
+{
+        int ret = 0;
+        char num[12];
+        size_t len = uitoa(value, num, 10);
+
+        SYSCALL(ret, SYS_WRITE, STDOUT, name, strlen(name));
+        SYSCALL(ret, SYS_WRITE, STDOUT, num, len);
+        SYSCALL(ret, SYS_WRITE, STDOUT, "\n", 1);
+}
+
+static void
+shell_heap(void)
+{
+        int ret = 0;
+        vmm_stats_t stats;
+        SYSCALL(ret, SYS_HEAPSTAT, &stats);
+
+        shell_print_num("allocated bytes: ", stats.bytes_allocated);
+        shell_print_num("peak bytes: ", stats.bytes_peak);
+        shell_print_num("free bytes: ", stats.bytes_free);
+        shell_print_num("largest free block: ", stats.largest_free);
+        shell_print_num("free nodes: ", stats.nodes);
+        shell_print_num("list allocs: ", stats.list_allocs);
+        shell_print_num("list frees: ", stats.list_frees);
+        shell_print_num("block allocs: ", stats.block_allocs);
+        shell_print_num("block frees: ", stats.block_frees);
+        shell_print_num("run allocs: ", stats.run_allocs);
+        shell_print_num("run frees: ", stats.run_frees);
+
+        for (uint32_t i = 0; i < VMM_CLASSES; ++i) {
+                char name[32] = "class ";
+                size_t len = uitoa(VMM_CLASS_MIN << i, &name[6], 10) + 6;
+                memcpy(&name[len], " allocs: ", 10);
+                shell_print_num(name, stats.class_allocs[i]);
+                memcpy(&name[len], " frees: ", 9);
+                shell_print_num(name, stats.class_frees[i]);
+        }
+
+        shell_print_num("list alloc kcycles: ", stats.list_alloc_cycles / 1000);
+        shell_print_num("kfree kcycles: ", stats.kfree_cycles / 1000);
+}
+
 static void
 shell_parse(char *buffer)
 {
@@ -144,6 +188,22 @@ shell_parse(char *buffer)
                 }
                 break;
 
+        case 'h':
+                if (!memcmp(buffer, "heap", 4)) {
+                        shell_heap();
+                } else {
+                        goto shell_input_error;
+                }
+                break;
+
+        case 's':
+                if (!memcmp(buffer, "sync", 4)) {
+                        SYSCALL(ret, SYS_SYNC);
+                } else {
+                        goto shell_input_error;
+                }
+                break;
+
         default: {
 shell_input_error:
                 SYSCALL(ret, SYS_WRITE, STDOUT, ERR_CMD1, strlen(ERR_CMD1));
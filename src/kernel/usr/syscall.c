@@ -9,12 +9,19 @@
 #include <kernel/pipe.h>
 #include <kernel/dirent.h>
 #include <kernel/vmm.h>
+#include <kernel/bio.h>
 #include <string.h>
 #include <stdlib.h>
 
 extern void syscall_handler(void);
 uintptr_t syscall_table[SYSCALL_COUNT];
 
+static int
+syscall_fork(void)
+{
+        return task_fork();
+}
+
 static int
 syscall_read(int fd, void *buffer, size_t size)
 {
@@ -143,6 +150,22 @@ syscall_readdir(struct dirent **entries, char *path)
         }
 }
 
+static int
+syscall_sync(void)
+{
+        bio_sync();
+        return 0;
+}
+
+/* stats are also dumped over serial */
+static int
+syscall_heapstat(vmm_stats_t *stats)
+{
+        vmm_get_stats(stats);
+        vmm_print_stats();
+        return 0;
+}
+
 int
 syscall_not_impl(void)
 {
@@ -150,17 +173,25 @@ syscall_not_impl(void)
         return -1;
 }
 
+/* sysenter msrs are per cpu */
 void
-syscall_init(void)
+syscall_cpu_init(uintptr_t esp0)
 {
         WRMSR(SYSENTER_CS_REG, 0x8, 0);
-        WRMSR(SYSENTER_ESP_REG, tss->esp0, 0);
+        WRMSR(SYSENTER_ESP_REG, esp0, 0);
         WRMSR(SYSENTER_EIP_REG, syscall_handler, 0);
+}
+
+void
+syscall_init(void)
+{
+        syscall_cpu_init(tss->esp0);
 
         /* tmp solution for not implemented syscalls */
         for (int i = 0; i < SYSCALL_COUNT; ++i)
                 syscall_table[i] = (uintptr_t) syscall_not_impl;
         
+        syscall_table[SYS_FORK] = (uintptr_t) syscall_fork; 
         syscall_table[SYS_READ] = (uintptr_t) syscall_read; 
         syscall_table[SYS_WRITE] = (uintptr_t) syscall_write; 
         syscall_table[SYS_OPEN] = (uintptr_t) syscall_open; 
@@ -172,5 +203,7 @@ syscall_init(void)
         syscall_table[SYS_MKDIR] = (uintptr_t) syscall_mkdir; 
         syscall_table[SYS_DUP] = (uintptr_t) syscall_dup; 
         syscall_table[SYS_PIPE] = (uintptr_t) syscall_pipe; 
+        syscall_table[SYS_SYNC] = (uintptr_t) syscall_sync; 
         syscall_table[SYS_READDIR] = (uintptr_t) syscall_readdir; 
+        syscall_table[SYS_HEAPSTAT] = (uintptr_t) syscall_heapstat; 
 }